@@ -1,19 +1,38 @@
 #include <errno.h>
 #include <limits.h>
 #include <locale.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <termios.h>
 #include <unistd.h>
+#ifdef CHIP8_ALSA
+#include <alsa/asoundlib.h>
+#endif
 
 #define PROGRAM_MAX_SIZE (0xEA0 - 0x200)
+#define XOCHIP_MAX_SIZE  (0x10000 - 0x200)
+#define MEMORY_SIZE      (0x10000 + 0x160) /* XO-CHIP address space plus the relocated stack, V and bitmap */
 #define STACK_MAX_SIZE   32
+#define FRAME_TIME_NS    INT64_C(16666667)
 
+#ifndef CHIP8_FUZZ
 static uint8_t DemoRandomTimer[] =
 {
 	0x00, 0xE0, 0xC0, 0x0F, 0xF0, 0x29, 0x61, 0x1C,
@@ -21,6 +40,7 @@ static uint8_t DemoRandomTimer[] =
 	0xF4, 0x07, 0x34, 0x00, 0x12, 0x10, 0xD1, 0x25,
 	0x12, 0x02
 };
+#endif
 
 enum chip8_quirks
 {
@@ -34,26 +54,107 @@ enum chip8_quirks
 	CHIP8_QUIRK_ORIGINAL    = CHIP8_QUIRK_INCREMENT_I | CHIP8_QUIRK_RESET_VF | CHIP8_QUIRK_VBLANK_WAIT
 };
 
+enum chip8_mode
+{
+	CHIP8_MODE_CHIP8  = 0, /* 64x32 bitmap aliased in mem[], 4 KB */
+	CHIP8_MODE_SCHIP  = 1, /* adds 128x64 hires, scrolling, 16x16 sprites, large font and flags */
+	CHIP8_MODE_XOCHIP = 2  /* adds 64 KB memory, two bitplanes and audio patterns */
+};
+
+/* SCHIP and XO-CHIP screen, two bitplanes of 64 rows by 128 pixels. Each row is
+ * a pair of words with the leftmost pixel in the most significant bit of the
+ * first, so drawing and scrolling work on whole rows. In lores only the first
+ * 32 rows and the first word of each row are used.
+ */
+struct chip8_display
+{
+	uint64_t rows[2][64][2];
+};
+
 struct chip8_program
 {
 	uint16_t pc;
 	uint16_t sp;
-	uint16_t stack;
+	uint32_t stack;
 	uint16_t i;
-	uint16_t v;
-	uint16_t bm;
+	uint32_t v;
+	uint32_t bm;
 	uint16_t len;
+	uint16_t mask;       /* address mask for I, 0xFFF or 0xFFFF */
+	uint16_t top;        /* last address an opcode may occupy */
 	uint8_t sound;
 	uint8_t timer;
-	uint8_t mem[0x1000];
+	uint8_t mode;        /* enum chip8_mode */
+	uint8_t hires;
+	uint8_t planes;      /* planes selected by FN01 */
+	uint8_t pitch;       /* FX3A */
+	uint8_t flags[16];   /* FX75 and FX85 */
+	uint8_t pattern[16]; /* F002 */
+	uint8_t pattern_loaded; /* the buzzer plays pattern instead of a square wave */
+	struct chip8_display display;
+	uint8_t mem[MEMORY_SIZE];
+};
+
+struct chip8_governor
+{
+	int cpu_share;          /* percent of each frame the interpreter may use; 0 disables the governor */
+	int opcodes_min;        /* lower bound for opcodes_per_frame */
+	int opcodes_max;        /* upper bound for opcodes_per_frame, i.e. the target emulated speed */
+	int64_t opcode_cost;    /* smoothed host time per opcode in 1/256 ns */
+	int64_t opcodes;        /* totals since the first frame, for reporting */
+	int64_t busy;
+	int64_t start;
+};
+
+/* Why the interpreter set Dump and Stop */
+enum chip8_fault
+{
+	CHIP8_FAULT_NONE            = 0x0,
+	CHIP8_FAULT_STACK_UNDERFLOW = 0x1, /* 00EE with an empty stack */
+	CHIP8_FAULT_STACK_OVERFLOW  = 0x2, /* 2NNN with a full stack */
+	CHIP8_FAULT_PC              = 0x4, /* PC outside 0x1FC to the top of memory */
+	CHIP8_FAULT_LOOP            = 0x8  /* PC did not move and the opcode was neither FX0A nor a jump to itself */
 };
 
+/* Interpreter engines; switch is the reference the others are checked
+ * against with -lockstep
+ */
+enum chip8_engine
+{
+	CHIP8_ENGINE_SWITCH    = 0,
+	CHIP8_ENGINE_PREDECODE = 1  /* caches decoded opcodes per address; a test engine, not faster */
+};
+
+#ifndef CHIP8_FUZZ
+static const char *EngineNames[] = { "switch", "predecode" };
+#endif
+
+struct audio;
+struct shm_export;
+struct capture;
+struct trace;
+struct debugger;
+struct lockstep;
+struct chip8_decoded;
+
 struct chip8_context
 {
 	struct chip8_program *program;
 	int opcodes_per_frame;
 	int keypad_response_time;
 	enum chip8_quirks quirks;
+	struct chip8_governor governor;
+	struct audio *audio; /* NULL rings the terminal bell instead, unless headless */
+	struct shm_export *shm;
+	struct capture *capture;
+	struct trace *trace;
+	struct debugger *debug; /* NULL when no debugger is attached */
+	enum chip8_engine engine;
+	struct chip8_decoded *decoded; /* 64K entries for CHIP8_ENGINE_PREDECODE */
+	struct lockstep *lockstep;
+	uint32_t rng;        /* xorshift state for a reproducible RND; 0 uses arc4random */
+	enum chip8_fault fault;
+	bool headless;       /* no terminal; stdout may carry a capture */
 };
 
 struct chip8_opcode
@@ -66,6 +167,13 @@ struct chip8_opcode
 	uint8_t group;
 };
 
+/* A decoded opcode, dropped when either of its bytes is written */
+struct chip8_decoded
+{
+	struct chip8_opcode opcode;
+	bool valid;
+};
+
 struct keypad
 {
 	int64_t time[16];
@@ -93,9 +201,29 @@ static uint8_t Fonts[] = {
 	0xF0, 0x80, 0xF0, 0x80, 0xF0, /* Font E */
 	0xF0, 0x80, 0xF0, 0x80, 0x80  /* Font F */
 };
+
+static uint8_t BigFonts[] = {
+	0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, /* Font 0 */
+	0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, /* Font 1 */
+	0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, /* Font 2 */
+	0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, /* Font 3 */
+	0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, /* Font 4 */
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, /* Font 5 */
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, /* Font 6 */
+	0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, /* Font 7 */
+	0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, /* Font 8 */
+	0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, /* Font 9 */
+	0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, /* Font A */
+	0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, /* Font B */
+	0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, /* Font C */
+	0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, /* Font D */
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, /* Font E */
+	0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  /* Font F */
+};
 static volatile sig_atomic_t Stop = 0;
 static volatile sig_atomic_t Dump = 0;
 
+#ifndef CHIP8_FUZZ
 static void
 os_write(int fd, char *s, size_t n)
 {
@@ -128,6 +256,280 @@ os_beep(void)
 {
 	write_byte(07);
 }
+#endif
+
+/* Audio is generated on the emulation thread, AUDIO_FRAME samples per 60 Hz
+ * timer tick, and handed to a sink thread through a single producer, single
+ * consumer ring. The producer never waits: when the sink falls behind the
+ * samples that do not fit are dropped and counted.
+ */
+#define AUDIO_RATE       48000
+#define AUDIO_FRAME      (AUDIO_RATE / 60)
+#define AUDIO_RING_SIZE  (1 << 14) /* power of two, about 340 ms */
+#define AUDIO_AMPLITUDE  6000
+#define AUDIO_BUZZER_HZ  440
+
+enum audio_sink
+{
+	AUDIO_SINK_NULL,
+	AUDIO_SINK_WAV,
+	AUDIO_SINK_ALSA
+};
+
+/* head is only written by the producer and tail only by the consumer; each
+ * sits on its own cache line so the two threads do not share one.
+ */
+struct audio_ring
+{
+	_Alignas(64) _Atomic size_t head;
+	_Alignas(64) _Atomic size_t tail;
+	_Alignas(64) int16_t samples[AUDIO_RING_SIZE];
+};
+
+struct audio
+{
+	struct audio_ring ring;
+	enum audio_sink sink;
+	FILE *file;
+#ifdef CHIP8_ALSA
+	snd_pcm_t *pcm;
+#endif
+	pthread_t thread;
+	bool threaded;
+	atomic_bool stop;
+	uint32_t phase;    /* position in the current wave cycle, a full cycle is 2^32 */
+	uint64_t written;  /* samples taken by the sink */
+	uint64_t dropped;  /* samples that did not fit in the ring */
+};
+
+#ifndef CHIP8_FUZZ
+static size_t
+audio_ring_write(struct audio_ring *ring, const int16_t *src, size_t n)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t space = AUDIO_RING_SIZE - (head - tail);
+	if (n > space) {
+		n = space;
+	}
+	for (size_t k = 0; k < n; k++) {
+		ring->samples[(head + k) & (AUDIO_RING_SIZE - 1)] = src[k];
+	}
+	atomic_store_explicit(&ring->head, head + n, memory_order_release);
+	return n;
+}
+
+static size_t
+audio_ring_read(struct audio_ring *ring, int16_t *dst, size_t n)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (n > head - tail) {
+		n = head - tail;
+	}
+	for (size_t k = 0; k < n; k++) {
+		dst[k] = ring->samples[(tail + k) & (AUDIO_RING_SIZE - 1)];
+	}
+	atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+	return n;
+}
+
+static void
+put_le(uint8_t *dst, uint32_t value, int bytes)
+{
+	for (int k = 0; k < bytes; k++) {
+		dst[k] = (uint8_t)(value >> (8 * k));
+	}
+}
+
+/* Sizes are patched by audio_close, a header left at zero means the run
+ * did not finish
+ */
+static void
+wav_write_header(FILE *file, uint64_t samples)
+{
+	uint8_t h[44];
+	uint32_t data = (uint32_t)(samples * 2);
+	memcpy(h + 0, "RIFF", 4);
+	put_le(h + 4, 36 + data, 4);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put_le(h + 16, 16, 4);
+	put_le(h + 20, 1, 2);              /* PCM */
+	put_le(h + 22, 1, 2);              /* mono */
+	put_le(h + 24, AUDIO_RATE, 4);
+	put_le(h + 28, AUDIO_RATE * 2, 4); /* bytes per second */
+	put_le(h + 32, 2, 2);              /* bytes per frame */
+	put_le(h + 34, 16, 2);             /* bits per sample */
+	memcpy(h + 36, "data", 4);
+	put_le(h + 40, data, 4);
+	fwrite(h, sizeof h, 1, file);
+}
+
+static void
+audio_sink_write(struct audio *audio, int16_t *src, size_t n)
+{
+	audio->written += n;
+	switch (audio->sink) {
+	case AUDIO_SINK_NULL:
+		break;
+	case AUDIO_SINK_WAV: {
+		uint8_t bytes[AUDIO_FRAME * 2];
+		for (size_t k = 0; k < n; k++) {
+			put_le(bytes + 2 * k, (uint16_t)src[k], 2);
+		}
+		fwrite(bytes, 2, n, audio->file);
+		break;
+	}
+	case AUDIO_SINK_ALSA:
+#ifdef CHIP8_ALSA
+		while (n) {
+			snd_pcm_sframes_t r = snd_pcm_writei(audio->pcm, src, n);
+			if (r < 0) {
+				if (snd_pcm_recover(audio->pcm, (int)r, 1) < 0) {
+					return;
+				}
+				continue;
+			}
+			src += r;
+			n -= (size_t)r;
+		}
+#endif
+		break;
+	}
+}
+
+/* Moves whatever is in the ring to the sink, at most one frame at a time */
+static bool
+audio_drain(struct audio *audio)
+{
+	int16_t buffer[AUDIO_FRAME];
+	size_t n = audio_ring_read(&audio->ring, buffer, AUDIO_FRAME);
+	if (n) {
+		audio_sink_write(audio, buffer, n);
+	}
+	return n != 0;
+}
+
+static void *
+audio_thread(void *arg)
+{
+	struct audio *audio = arg;
+	struct timespec idle = { .tv_sec = 0, .tv_nsec = 2000000 };
+	for (;;) {
+		/* read stop first so samples queued before it was set still go out */
+		bool stopping = atomic_load_explicit(&audio->stop, memory_order_acquire);
+		if (audio_drain(audio)) {
+			continue;
+		}
+		if (stopping) {
+			break;
+		}
+		nanosleep(&idle, NULL);
+	}
+	return NULL;
+}
+
+/* name is "null", "alsa" or the path of a WAV file. Without a thread the
+ * caller drains the ring itself, which headless runs use so that a dump
+ * never loses samples however fast the emulation runs.
+ */
+static bool
+audio_open(struct audio *audio, char *name, bool threaded)
+{
+	memset(audio, 0, sizeof *audio);
+	if (strcmp(name, "null") == 0) {
+		audio->sink = AUDIO_SINK_NULL;
+	} else if (strcmp(name, "alsa") == 0) {
+		audio->sink = AUDIO_SINK_ALSA;
+#ifdef CHIP8_ALSA
+		int err = snd_pcm_open(&audio->pcm, "default", SND_PCM_STREAM_PLAYBACK, 0);
+		if (err >= 0) {
+			err = snd_pcm_set_params(audio->pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED,
+						 1, AUDIO_RATE, 1, 50000);
+		}
+		if (err < 0) {
+			fprintf(stderr, "error: cannot open ALSA device: %s\n", snd_strerror(err));
+			return false;
+		}
+#else
+		fprintf(stderr, "error: built without ALSA support, rebuild with ALSA=1\n");
+		return false;
+#endif
+	} else {
+		audio->sink = AUDIO_SINK_WAV;
+		audio->file = fopen(name, "wb");
+		if (!audio->file) {
+			fprintf(stderr, "error: cannot open %s: %s\n", name, strerror(errno));
+			return false;
+		}
+		wav_write_header(audio->file, 0);
+	}
+
+	if (threaded) {
+		if (pthread_create(&audio->thread, NULL, audio_thread, audio) != 0) {
+			fprintf(stderr, "error: cannot start audio thread\n");
+			return false;
+		}
+		audio->threaded = true;
+	}
+	return true;
+}
+
+static void
+audio_close(struct audio *audio)
+{
+	if (audio->threaded) {
+		atomic_store_explicit(&audio->stop, true, memory_order_release);
+		pthread_join(audio->thread, NULL);
+	} else {
+		while (audio_drain(audio)) {
+		}
+	}
+	if (audio->file) {
+		fseek(audio->file, 0, SEEK_SET);
+		wav_write_header(audio->file, audio->written);
+		fclose(audio->file);
+	}
+#ifdef CHIP8_ALSA
+	if (audio->pcm) {
+		snd_pcm_drain(audio->pcm);
+		snd_pcm_close(audio->pcm);
+	}
+#endif
+	if (audio->dropped) {
+		fprintf(stderr, "audio: %llu samples dropped\n", (unsigned long long)audio->dropped);
+	}
+}
+
+/* One timer tick of sound. XO-CHIP plays the 128 bit pattern at
+ * 4000*2^((pitch-64)/48) bits per second once F002 has loaded one,
+ * everything else a square wave. Silence is generated too so the output
+ * stays in step with the emulated frames.
+ */
+static void
+audio_generate(struct audio *audio, struct chip8_program *program)
+{
+	int16_t buffer[AUDIO_FRAME];
+	if (!program->sound) {
+		memset(buffer, 0, sizeof buffer);
+	} else if (program->pattern_loaded) {
+		double bits = 4000.0 * exp2((program->pitch - 64) / 48.0);
+		uint32_t step = (uint32_t)(bits * (double)(1 << 25) / AUDIO_RATE);
+		for (int k = 0; k < AUDIO_FRAME; k++) {
+			unsigned bit = audio->phase >> 25;
+			bool on = program->pattern[bit / 8] & (0x80 >> (bit % 8));
+			buffer[k] = on ? AUDIO_AMPLITUDE : -AUDIO_AMPLITUDE;
+			audio->phase += step;
+		}
+	} else {
+		uint32_t step = (uint32_t)(((uint64_t)AUDIO_BUZZER_HZ << 32) / AUDIO_RATE);
+		for (int k = 0; k < AUDIO_FRAME; k++) {
+			buffer[k] = (audio->phase >> 31) ? AUDIO_AMPLITUDE : -AUDIO_AMPLITUDE;
+			audio->phase += step;
+		}
+	}
+	audio->dropped += AUDIO_FRAME - audio_ring_write(&audio->ring, buffer, AUDIO_FRAME);
+}
 
 #define PIXEL_SIZE	3
 #define BITMAP_STRIDE	(64 * PIXEL_SIZE + 2)
@@ -163,6 +565,72 @@ os_bit_blit(uint8_t *src)
 	write_str(BitmapDest, sizeof BitmapDest);
 }
 
+/* The SCHIP and XO-CHIP screen is drawn with half blocks, two pixel rows per
+ * line, so hires fits in 128x32 cells; lores pixels are doubled. Each
+ * combination of planes has its own colour.
+ */
+#define DISPLAY_CELL_SIZE 16
+static char DisplayDest[8 + 32 * (128 * DISPLAY_CELL_SIZE + 2) + 4];
+static const char *DisplayColors[4][2] = {
+	{ "39", "49" }, { "92", "102" }, { "93", "103" }, { "97", "107" }
+};
+
+static char *
+put_str(char *dst, const char *s)
+{
+	while (*s) {
+		*dst++ = *s++;
+	}
+	return dst;
+}
+
+static unsigned
+display_pixel(struct chip8_display *display, unsigned x, unsigned y)
+{
+	uint64_t bit = UINT64_C(1) << (63 - x % 64);
+	return ((display->rows[0][y][x / 64] & bit) ? 1u : 0u) | ((display->rows[1][y][x / 64] & bit) ? 2u : 0u);
+}
+
+static void
+os_display_blit(struct chip8_program *program)
+{
+	struct chip8_display *display = &program->display;
+	unsigned scale = program->hires ? 1 : 2;
+	unsigned fg = UINT_MAX;
+	unsigned bg = UINT_MAX;
+	char *dst = put_str(DisplayDest, "\033[H");
+	for (unsigned line = 0; line < 32; line++) {
+		for (unsigned x = 0; x < 128; x++) {
+			unsigned top = display_pixel(display, x / scale, 2 * line / scale);
+			unsigned bottom = display_pixel(display, x / scale, (2 * line + 1) / scale);
+			unsigned want_fg = top;
+			unsigned want_bg = 0;
+			const char *glyph = "\xE2\x96\x80"; /* upper half block */
+			if (top == bottom) {
+				glyph = top ? "\xE2\x96\x88" : " ";
+			} else if (!top) {
+				glyph = "\xE2\x96\x84"; /* lower half block */
+				want_fg = bottom;
+			} else {
+				want_bg = bottom;
+			}
+			if (want_fg != fg || want_bg != bg) {
+				fg = want_fg;
+				bg = want_bg;
+				dst = put_str(dst, "\033[");
+				dst = put_str(dst, DisplayColors[fg][0]);
+				dst = put_str(dst, ";");
+				dst = put_str(dst, DisplayColors[bg][1]);
+				dst = put_str(dst, "m");
+			}
+			dst = put_str(dst, glyph);
+		}
+		dst = put_str(dst, "\r\n");
+	}
+	dst = put_str(dst, "\033[0m");
+	write_str(DisplayDest, (size_t)(dst - DisplayDest));
+}
+
 static bool
 os_is_key_pressed(void)
 {
@@ -264,13 +732,14 @@ os_wait_frame(int64_t start)
 {
 	int64_t now = os_get_time();
 	int64_t elapsed = now - start;
-	int64_t frame_rate = 16666667;
+	int64_t frame_rate = FRAME_TIME_NS;
 	if (elapsed < frame_rate) {
 		struct timespec sleep = { .tv_sec = 0, .tv_nsec = frame_rate - elapsed };
 		while (nanosleep(&sleep, &sleep) == -1 && errno == EINTR) {
 		}
 	}
 }
+#endif
 
 static struct chip8_opcode
 opcode_from_bytes(uint8_t hi, uint8_t lo)
@@ -286,21 +755,37 @@ opcode_from_bytes(uint8_t hi, uint8_t lo)
 	};
 }
 
+#ifndef CHIP8_FUZZ
 static bool
 opcode_to_string(char *dst, size_t len, struct chip8_opcode opcode)
 {
 	switch (opcode.group) {
 	case 0x0:
 		switch (opcode.nnn) {
-		case 0xE0: snprintf(dst, len, "cls"); return true;
-		case 0xEE: snprintf(dst, len, "ret"); return true;
+		case 0xE0: snprintf(dst, len, "cls");  return true;
+		case 0xEE: snprintf(dst, len, "ret");  return true;
+		case 0xFB: snprintf(dst, len, "scr");  return true;
+		case 0xFC: snprintf(dst, len, "scl");  return true;
+		case 0xFD: snprintf(dst, len, "exit"); return true;
+		case 0xFE: snprintf(dst, len, "low");  return true;
+		case 0xFF: snprintf(dst, len, "high"); return true;
+		}
+		switch (opcode.nnn & 0xFF0) {
+		case 0xC0: snprintf(dst, len, "scd  0x%x", opcode.n); return true;
+		case 0xD0: snprintf(dst, len, "scu  0x%x", opcode.n); return true;
 		}
 		break;
 	case 0x1: snprintf(dst, len, "jp   0x%03x",       opcode.nnn);           return true;
 	case 0x2: snprintf(dst, len, "call 0x%03x",       opcode.nnn);           return true;
 	case 0x3: snprintf(dst, len, "se   %%%x, 0x%02x", opcode.vx, opcode.nn); return true;
 	case 0x4: snprintf(dst, len, "sne  %%%x, 0x%02x", opcode.vx, opcode.nn); return true;
-	case 0x5: snprintf(dst, len, "se   %%%x, %%%x",   opcode.vx, opcode.vy); return true;
+	case 0x5:
+		switch (opcode.n) {
+		case 0x2: snprintf(dst, len, "save %%%x, %%%x", opcode.vx, opcode.vy); return true;
+		case 0x3: snprintf(dst, len, "load %%%x, %%%x", opcode.vx, opcode.vy); return true;
+		}
+		snprintf(dst, len, "se   %%%x, %%%x", opcode.vx, opcode.vy);
+		return true;
 	case 0x6: snprintf(dst, len, "ld   %%%x, 0x%02x", opcode.vx, opcode.nn); return true;
 	case 0x7: snprintf(dst, len, "add  %%%x, 0x%02x", opcode.vx, opcode.nn); return true;
 	case 0x8:
@@ -329,85 +814,408 @@ opcode_to_string(char *dst, size_t len, struct chip8_opcode opcode)
 		break;
 	case 0xF:
 		switch (opcode.nn) {
+		case 0x01: snprintf(dst, len, "pln  0x%x",      opcode.vx); return true;
 		case 0x07: snprintf(dst, len, "ld   %%%x, $dt", opcode.vx); return true;
 		case 0x0A: snprintf(dst, len, "ld   %%%x, $kb", opcode.vx); return true;
 		case 0x15: snprintf(dst, len, "ld   $dt, %%%x", opcode.vx); return true;
 		case 0x18: snprintf(dst, len, "ld   $st, %%%x", opcode.vx); return true;
 		case 0x1E: snprintf(dst, len, "add  %%i, %%%x", opcode.vx); return true;
 		case 0x29: snprintf(dst, len, "fnt  %%%x",      opcode.vx); return true;
+		case 0x30: snprintf(dst, len, "hfnt %%%x",      opcode.vx); return true;
+		case 0x3A: snprintf(dst, len, "ld   $pt, %%%x", opcode.vx); return true;
 		case 0x33: snprintf(dst, len, "bcd  %%%x",      opcode.vx); return true;
 		case 0x55: snprintf(dst, len, "ld   %%i, %%%x", opcode.vx); return true;
 		case 0x65: snprintf(dst, len, "ld   %%%x, %%i", opcode.vx); return true;
+		case 0x75: snprintf(dst, len, "ld   $rpl, %%%x", opcode.vx); return true;
+		case 0x85: snprintf(dst, len, "ld   %%%x, $rpl", opcode.vx); return true;
+		}
+		switch (opcode.nnn) {
+		case 0x000: snprintf(dst, len, "ld   %%i, long"); return true;
+		case 0x002: snprintf(dst, len, "ld   $pat, %%i"); return true;
 		}
 		break;
 	}
 	return false;
 }
 
+enum chip8_addr_flags
+{
+	CHIP8_ADDR_CODE     = 0x01, /* first byte of a reachable opcode */
+	CHIP8_ADDR_OPERAND  = 0x02, /* second byte of a reachable opcode */
+	CHIP8_ADDR_LEADER   = 0x04, /* first opcode of a basic block */
+	CHIP8_ADDR_CALL     = 0x08, /* target of 2NNN */
+	CHIP8_ADDR_INDIRECT = 0x10  /* BNNN, the successors depend on a register */
+};
+
+#define CHIP8_NO_ADDR UINT16_MAX
+
+struct chip8_block
+{
+	uint16_t beg;     /* address of the first opcode */
+	uint16_t end;     /* address of the last opcode */
+	uint16_t next[2]; /* successors, CHIP8_NO_ADDR if unused */
+	uint16_t call;    /* 2NNN target, CHIP8_NO_ADDR if none */
+};
+
+struct chip8_call
+{
+	uint16_t caller;  /* entry of the calling subroutine */
+	uint16_t callee;
+};
+
+struct chip8_cfg
+{
+	uint32_t beg;
+	uint32_t end;
+	size_t nblocks;
+	size_t ncalls;
+	uint8_t flags[0x10000];
+	struct chip8_block blocks[0x8000];
+	struct chip8_call calls[0x1000];
+	uint16_t work[0x10000];
+	uint8_t seen[0x10000];
+};
+
+/* XO-CHIP F000 NNNN is the only opcode longer than two bytes */
+static uint16_t
+opcode_size(uint8_t *mem, uint32_t pc)
+{
+	return mem[pc] == 0xF0 && mem[pc+1] == 0x00 ? 4 : 2;
+}
+
+/* Returns the number of successors of the opcode at pc, which are stored in
+ * next[]. A 2NNN target is returned in *call rather than next[]. Returns -1
+ * when the opcode is not valid.
+ */
+static int
+opcode_successors(uint8_t *mem, uint16_t pc, uint16_t next[2], uint16_t *call)
+{
+	char str[24];
+	struct chip8_opcode opcode = opcode_from_bytes(mem[pc], mem[pc+1]);
+	*call = CHIP8_NO_ADDR;
+	if (!opcode_to_string(str, sizeof str, opcode)) {
+		return -1;
+	}
+	switch (opcode.group) {
+	case 0x0:
+		if (opcode.nnn == 0xEE) {
+			return 0;
+		}
+		break;
+	case 0x1:
+		next[0] = opcode.nnn;
+		return 1;
+	case 0x2:
+		*call = opcode.nnn;
+		break;
+	case 0x3: case 0x4: case 0x5: case 0x9: case 0xE:
+		if (opcode.group == 0x5 && (opcode.n == 0x2 || opcode.n == 0x3)) {
+			break;
+		}
+		next[0] = (pc + 2) & 0xFFFF;
+		next[1] = (pc + 2 + opcode_size(mem, pc + 2u)) & 0xFFFF;
+		return 2;
+	case 0xB:
+		/* only the V0 = 0 target is known statically */
+		next[0] = opcode.nnn;
+		return 1;
+	}
+	next[0] = (pc + opcode_size(mem, pc)) & 0xFFFF;
+	return 1;
+}
+
+static void
+cfg_push(struct chip8_cfg *cfg, size_t *nwork, uint16_t addr, uint8_t flags)
+{
+	if (addr < cfg->beg || addr + 1u >= cfg->end) {
+		return;
+	}
+	bool pending = cfg->flags[addr] & CHIP8_ADDR_LEADER;
+	cfg->flags[addr] |= CHIP8_ADDR_LEADER | flags;
+	if (!pending) {
+		cfg->work[(*nwork)++] = addr;
+	}
+}
+
+/* Recursive descent from each root through every jump, call and skip target.
+ * Addresses are not assumed to be even; ROMs such as INVADERS jump to odd
+ * addresses. Bytes never reached as an opcode are treated as data.
+ */
+static void
+chip8_analyze(struct chip8_cfg *cfg, uint8_t *mem, uint32_t beg, uint32_t end, uint16_t *roots, size_t nroots)
+{
+	uint16_t *work = cfg->work;
+	size_t nwork = 0;
+
+	memset(cfg->flags, 0, sizeof cfg->flags);
+	cfg->beg = beg;
+	cfg->end = end;
+	cfg->nblocks = 0;
+	cfg->ncalls = 0;
+	for (size_t i = 0; i < nroots; i++) {
+		cfg_push(cfg, &nwork, roots[i], 0);
+	}
+
+	while (nwork) {
+		uint16_t pc = work[--nwork];
+		while (pc >= beg && pc + opcode_size(mem, pc) <= end && !(cfg->flags[pc] & CHIP8_ADDR_CODE)) {
+			uint16_t size = opcode_size(mem, pc);
+			uint16_t next[2];
+			uint16_t call;
+			int count = opcode_successors(mem, pc, next, &call);
+			if (count < 0) {
+				break;
+			}
+			cfg->flags[pc] |= CHIP8_ADDR_CODE;
+			for (uint16_t k = 1; k < size; k++) {
+				cfg->flags[pc+k] |= CHIP8_ADDR_OPERAND;
+			}
+			if (call != CHIP8_NO_ADDR) {
+				cfg_push(cfg, &nwork, call, CHIP8_ADDR_CALL);
+				cfg_push(cfg, &nwork, (pc + 2) & 0xFFFF, 0);
+				break;
+			}
+			if (count == 1 && next[0] == pc + size) {
+				pc += size;
+				continue;
+			}
+			if ((mem[pc] & 0xF0) == 0xB0) {
+				cfg->flags[pc] |= CHIP8_ADDR_INDIRECT;
+				/* jump tables are usually a run of 1NNN opcodes */
+				for (uint32_t t = next[0]; t + 1 < end && (mem[t] & 0xF0) == 0x10; t += 2) {
+					cfg_push(cfg, &nwork, (uint16_t)t, 0);
+				}
+			}
+			for (int i = 0; i < count; i++) {
+				cfg_push(cfg, &nwork, next[i], 0);
+			}
+			break;
+		}
+	}
+
+	for (uint32_t addr = beg; addr < end; addr++) {
+		uint8_t leader = CHIP8_ADDR_LEADER | CHIP8_ADDR_CODE;
+		if ((cfg->flags[addr] & leader) != leader || cfg->nblocks == sizeof cfg->blocks / sizeof cfg->blocks[0]) {
+			continue;
+		}
+		struct chip8_block *block = &cfg->blocks[cfg->nblocks++];
+		block->beg = (uint16_t)addr;
+		block->next[0] = CHIP8_NO_ADDR;
+		block->next[1] = CHIP8_NO_ADDR;
+		for (uint32_t pc = addr;; pc += opcode_size(mem, pc)) {
+			uint16_t next[2];
+			int count = opcode_successors(mem, (uint16_t)pc, next, &block->call);
+			uint32_t fall = pc + opcode_size(mem, pc);
+			block->end = (uint16_t)pc;
+			if (block->call != CHIP8_NO_ADDR) {
+				block->next[0] = (pc + 2) & 0xFFFF;
+				break;
+			}
+			bool falls = count == 1 && next[0] == fall;
+			if (!falls || fall >= end || !(cfg->flags[fall] & CHIP8_ADDR_CODE) || (cfg->flags[fall] & CHIP8_ADDR_LEADER)) {
+				for (int i = 0; i < count; i++) {
+					block->next[i] = next[i];
+				}
+				break;
+			}
+		}
+	}
+
+	/* call graph: walk each subroutine without descending into its callees */
+	uint8_t *seen = cfg->seen;
+	for (uint32_t entry = beg; entry < end; entry++) {
+		bool is_root = false;
+		for (size_t i = 0; i < nroots; i++) {
+			is_root |= roots[i] == entry;
+		}
+		if (!(cfg->flags[entry] & CHIP8_ADDR_CODE) || !(is_root || (cfg->flags[entry] & CHIP8_ADDR_CALL))) {
+			continue;
+		}
+		memset(seen + beg, 0, end - beg);
+		nwork = 0;
+		work[nwork++] = (uint16_t)entry;
+		seen[entry] = 1;
+		while (nwork) {
+			uint16_t pc = work[--nwork];
+			uint16_t next[2];
+			uint16_t call;
+			int count = opcode_successors(mem, pc, next, &call);
+			if (call != CHIP8_NO_ADDR) {
+				bool known = false;
+				for (size_t i = 0; i < cfg->ncalls && !known; i++) {
+					known = cfg->calls[i].caller == entry && cfg->calls[i].callee == call;
+				}
+				if (!known && cfg->ncalls < sizeof cfg->calls / sizeof cfg->calls[0]) {
+					cfg->calls[cfg->ncalls++] = (struct chip8_call) { .caller = (uint16_t)entry, .callee = call };
+				}
+				next[0] = (pc + 2) & 0xFFFF;
+				count = 1;
+			}
+			for (int i = 0; i < count; i++) {
+				uint16_t t = next[i];
+				if (t >= beg && t < end && (cfg->flags[t] & CHIP8_ADDR_CODE) && !seen[t]) {
+					seen[t] = 1;
+					work[nwork++] = t;
+				}
+			}
+		}
+	}
+}
+
+struct out_buffer
+{
+	FILE *file;
+	size_t len;
+	char data[1 << 14];
+};
+
+static void
+out_flush(struct out_buffer *out)
+{
+	fwrite(out->data, 1, out->len, out->file);
+	fflush(out->file);
+	out->len = 0;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void
+out_printf(struct out_buffer *out, const char *fmt, ...)
+{
+	va_list ap;
+	size_t room = sizeof out->data - out->len;
+	va_start(ap, fmt);
+	int n = vsnprintf(out->data + out->len, room, fmt, ap);
+	va_end(ap);
+	if (n < 0) {
+		return;
+	}
+	if ((size_t)n >= room) {
+		out_flush(out);
+		va_start(ap, fmt);
+		n = vsnprintf(out->data, sizeof out->data, fmt, ap);
+		va_end(ap);
+		if (n < 0) {
+			return;
+		}
+		if ((size_t)n >= sizeof out->data) {
+			n = (int)sizeof out->data - 1;
+		}
+	}
+	out->len += (size_t)n;
+}
+
+static void
+chip8_cfg_print(struct out_buffer *out, struct chip8_cfg *cfg)
+{
+	out_printf(out, "; blocks: first last -> successors [call]\n");
+	for (size_t i = 0; i < cfg->nblocks; i++) {
+		struct chip8_block *block = &cfg->blocks[i];
+		out_printf(out, "%03x %03x ->", block->beg, block->end);
+		for (int n = 0; n < 2; n++) {
+			if (block->next[n] != CHIP8_NO_ADDR) {
+				out_printf(out, " %03x", block->next[n]);
+			}
+		}
+		if (block->call != CHIP8_NO_ADDR) {
+			out_printf(out, " [call %03x]", block->call);
+		}
+		if (cfg->flags[block->end] & CHIP8_ADDR_INDIRECT) {
+			out_printf(out, " [indirect]");
+		}
+		out_printf(out, "\n");
+	}
+	out_printf(out, "\n; calls: caller -> callees\n");
+	for (size_t i = 0; i < cfg->ncalls; i++) {
+		if (i && cfg->calls[i].caller == cfg->calls[i-1].caller) {
+			out_printf(out, " %03x", cfg->calls[i].callee);
+		} else {
+			out_printf(out, "%s%03x -> %03x", i ? "\n" : "", cfg->calls[i].caller, cfg->calls[i].callee);
+		}
+	}
+	out_printf(out, "%s\n", cfg->ncalls ? "\n" : "");
+}
+
 static void
 chip8_dump(FILE *dst, struct chip8_program *program, bool full)
 {
+	struct out_buffer buffer = { .file = dst, .len = 0 };
+	struct out_buffer *out = &buffer;
 	uint8_t *mem = program->mem;
 	if (full) {
 		uint8_t *stack = &mem[program->stack];
 		uint8_t *v = &mem[program->v];
-		fprintf(dst, "PC       0x%03X\n", program->pc);
-		fprintf(dst, "I        0x%03X\n", program->i);
-		fprintf(dst, "SP       0x%03X\n", program->sp);
-		fprintf(dst, "Timer    0x%02X\n", program->timer);
-		fprintf(dst, "Sound    0x%02X\n", program->sound);
-		fprintf(dst, "V        0x%03X  "
+		out_printf(out, "PC       0x%03X\n", program->pc);
+		out_printf(out, "I        0x%03X\n", program->i);
+		out_printf(out, "SP       0x%03X\n", program->sp);
+		out_printf(out, "Timer    0x%02X\n", program->timer);
+		out_printf(out, "Sound    0x%02X\n", program->sound);
+		out_printf(out, "V        0x%03X  "
 			"0:%02X 1:%02X 2:%02X 3:%02X 4:%02X 5:%02X 6:%02X 7:%02X 8:%02X 9:%02X A:%02X B:%02X C:%02X D:%02X E:%02X F:%02X\n",
-			program->v, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], v[9], v[10], v[11], v[12], v[13], v[14], v[15]);
-		fprintf(dst, "Stack    0x%03X  ", program->stack);
+			(unsigned)program->v, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], v[9], v[10], v[11], v[12], v[13], v[14], v[15]);
+		out_printf(out, "Stack    0x%03X  ", (unsigned)program->stack);
 		for (size_t i = 0; i < 32; i+=2) {
-			fprintf(dst, "0x%03X", stack[i] << 8 | stack[i+1]);
+			out_printf(out, "0x%03X", stack[i] << 8 | stack[i+1]);
 			if (i < 30) {
-				fprintf(dst, ", ");
+				out_printf(out, ", ");
 			}
 		}
-		fprintf(dst, "\n");
-		fprintf(dst, "Bitmap   0x%03X\n", program->bm);
+		out_printf(out, "\n");
+		out_printf(out, "Bitmap   0x%03X\n", (unsigned)program->bm);
 		struct chip8_opcode opcode = opcode_from_bytes(mem[program->pc], mem[program->pc+1]);
-		fprintf(dst, "Opcode   0x%03X Group:0x%01X VX:0x%02X VY:0x%02X N:0x%X NN:0x%02X NNN:0x%03X\n",
+		out_printf(out, "Opcode   0x%03X Group:0x%01X VX:0x%02X VY:0x%02X N:0x%X NN:0x%02X NNN:0x%03X\n",
 			mem[program->pc] << 8 | mem[program->pc+1], opcode.group, opcode.vx, opcode.vy, opcode.n, opcode.nn, opcode.nnn);
-		fprintf(dst, "\n");
+		out_printf(out, "\n");
 	}
 	if (full) {
-		fprintf(dst, "     0 1  2 3  4 5  6 7  8 9  A B  C D  E F\n");
+		out_printf(out, "     0 1  2 3  4 5  6 7  8 9  A B  C D  E F\n");
 	}
 	ptrdiff_t packidx = 0;
 	ptrdiff_t packmin = PTRDIFF_MAX;
 	ptrdiff_t packmax = full ? 16 : 1;
 	uint8_t *code_beg = &mem[full ? 0x1FC : 0x200];
 	uint8_t *beg = full ? mem : code_beg;
-	uint8_t *end = full ? (mem + (sizeof program->mem)) : (code_beg + program->len);
+	uint8_t *end = full ? (mem + program->mask + 1) : (code_beg + program->len);
 	uint8_t *cur = beg;
+
+	/* when running, also descend from the current PC and the return addresses */
+	static struct chip8_cfg cfg;
+	uint16_t roots[3 + STACK_MAX_SIZE / 2] = { 0x200 };
+	size_t nroots = 1;
+	if (full) {
+		roots[nroots++] = 0x1FC;
+		roots[nroots++] = program->pc;
+		for (uint16_t i = 0; i + 1 < program->sp && i + 1 < STACK_MAX_SIZE; i += 2) {
+			roots[nroots++] = (uint16_t)((mem[program->stack + i] << 8 | mem[program->stack + i + 1]) & program->mask);
+		}
+	}
+	chip8_analyze(&cfg, mem, (uint32_t)(code_beg - mem), full ? program->top + 1u : (uint32_t)(end - mem), roots, nroots);
+
 	while (cur < end) {
 		ptrdiff_t offset = cur - mem;
 		char str[18];
 		uint8_t *next = ((cur+1) < end) ? cur+1 : NULL;
-		/* some docs say opcodes start on even addresses but ROMs, such as INVADERS, start with a
-		 * jump to an odd address. need to fix this to parse the opcodes for jumps/call and support
-		 * odd addresses
-		 */
-		bool is_opcode = (cur >= code_beg) && (cur < (mem + 0xE9F)) && next && /*!((uintptr_t)cur & 1) &&*/
+		bool is_opcode = (cfg.flags[offset] & CHIP8_ADDR_CODE) && next &&
 			         opcode_to_string(str, sizeof str, opcode_from_bytes(*cur, *next));
 		if (is_opcode) {
 			if (packidx) {
-				fprintf(dst, "\n");
+				out_printf(out, "\n");
 				packidx = 0;
 			}
-			fprintf(dst, "%03zx: %02x%02x %s\n", offset, *cur, *next, str);
+			if (opcode_size(mem, (uint32_t)offset) == 4 && cur + 3 < end) {
+				out_printf(out, "%03zx: %02x%02x %02x%02x ld   %%i, 0x%04x\n", offset, cur[0], cur[1], cur[2], cur[3], cur[2] << 8 | cur[3]);
+				cur += 4;
+				continue;
+			}
+			out_printf(out, "%03zx: %02x%02x %s\n", offset, *cur, *next, str);
 			cur += 2;
 		} else {
 			if (packidx >= packmax || packidx >= packmin) {
-				fprintf(dst, "\n");
+				out_printf(out, "\n");
 				packidx = 0;
 			}
 
 			if (!packidx) {
-				fprintf(dst, "%03zx: ", offset);
+				out_printf(out, "%03zx: ", offset);
 				if (offset % packmax == 0) {
 					packmin = PTRDIFF_MAX;
 				} else {
@@ -416,13 +1224,13 @@ chip8_dump(FILE *dst, struct chip8_program *program, bool full)
 				}
 			}
 			else if (!(packidx & 1)) {
-				fprintf(dst, " ");
+				out_printf(out, " ");
 			}
 
 			if (*cur || !full) {
-				fprintf(dst, "%02x", *cur);
+				out_printf(out, "%02x", *cur);
 			} else {
-				fprintf(dst, "..");
+				out_printf(out, "..");
 			}
 
 			packidx++;
@@ -430,23 +1238,2238 @@ chip8_dump(FILE *dst, struct chip8_program *program, bool full)
 		}
 	}
 	if (packidx) {
-		fprintf(dst, "\n");
+		out_printf(out, "\n");
 	}
-	fprintf(dst, "\n");
+	out_printf(out, "\n");
+	out_flush(out);
 }
+#endif
 
+/* Mask for a sprite row of up to 64 bits, left aligned in bits, drawn at
+ * column x of a row cols pixels wide. Pixels past the right edge are dropped
+ * unless wrap is set, in which case they continue from column 0.
+ */
 static void
-chip8_exec(struct chip8_context *context)
+display_row_mask(uint64_t mask[2], uint64_t bits, unsigned x, unsigned cols, bool wrap)
 {
-	struct chip8_program *program = context->program;
-	enum chip8_quirks quirks = context->quirks;
+	uint64_t spill;
+	if (x < 64) {
+		mask[0] = bits >> x;
+		spill = x ? bits << (64 - x) : 0;
+		mask[1] = cols > 64 ? spill : 0;
+		if (cols > 64) {
+			spill = 0;
+		}
+	} else {
+		mask[0] = 0;
+		mask[1] = bits >> (x - 64);
+		spill = x > 64 ? bits << (128 - x) : 0;
+	}
+	if (wrap) {
+		mask[0] |= spill;
+	}
+}
+
+/* DXYN on the SCHIP/XO-CHIP screen; N = 0 draws a 16x16 sprite. Each selected
+ * plane takes the next sprite from memory. Returns true on a collision.
+ */
+static bool
+display_draw(struct chip8_program *program, uint8_t x, uint8_t y, uint8_t n, bool wrap)
+{
+	struct chip8_display *display = &program->display;
 	uint8_t *mem = program->mem;
-	uint8_t *stack = &mem[program->stack];
-	uint8_t *bitmap = &mem[program->bm];
+	unsigned cols = program->hires ? 128 : 64;
+	unsigned rows = program->hires ? 64 : 32;
+	unsigned width = n ? 8 : 16;
+	unsigned height = n ? n : 16;
+	unsigned addr = program->i;
+	bool collision = false;
+
+	x = (uint8_t)(x % cols);
+	y = (uint8_t)(y % rows);
+	for (unsigned plane = 0; plane < 2; plane++) {
+		if (!(program->planes & (1 << plane))) {
+			continue;
+		}
+		for (unsigned r = 0; r < height; r++) {
+			unsigned yc = y + r;
+			if (yc >= rows) {
+				if (!wrap) {
+					break;
+				}
+				yc -= rows;
+			}
+			uint64_t bits;
+			if (width == 16) {
+				bits = (uint64_t)mem[(addr + 2 * r) & program->mask] << 8 | mem[(addr + 2 * r + 1) & program->mask];
+			} else {
+				bits = mem[(addr + r) & program->mask];
+			}
+			uint64_t mask[2];
+			display_row_mask(mask, bits << (64 - width), x, cols, wrap);
+			uint64_t *row = display->rows[plane][yc];
+			collision |= ((row[0] & mask[0]) | (row[1] & mask[1])) != 0;
+			row[0] ^= mask[0];
+			row[1] ^= mask[1];
+		}
+		addr += width / 8 * height;
+	}
+	return collision;
+}
+
+static void
+display_clear(struct chip8_program *program, uint8_t planes)
+{
+	for (unsigned plane = 0; plane < 2; plane++) {
+		if (planes & (1 << plane)) {
+			memset(program->display.rows[plane], 0, sizeof program->display.rows[plane]);
+		}
+	}
+}
+
+/* 00CN, 00DN, 00FB and 00FC. Vertical scrolls move whole rows; horizontal
+ * scrolls shift each row as a 128-bit value, which compilers vectorise.
+ */
+static void
+display_scroll(struct chip8_program *program, int dx, int dy)
+{
+	unsigned rows = program->hires ? 64 : 32;
+	for (unsigned plane = 0; plane < 2; plane++) {
+		if (!(program->planes & (1 << plane))) {
+			continue;
+		}
+		uint64_t (*row)[2] = program->display.rows[plane];
+		if (dy > 0) {
+			unsigned n = (unsigned)dy < rows ? (unsigned)dy : rows;
+			memmove(row[n], row[0], (rows - n) * sizeof row[0]);
+			memset(row[0], 0, n * sizeof row[0]);
+		} else if (dy < 0) {
+			unsigned n = (unsigned)-dy < rows ? (unsigned)-dy : rows;
+			memmove(row[0], row[n], (rows - n) * sizeof row[0]);
+			memset(row[rows - n], 0, n * sizeof row[0]);
+		}
+		if (dx > 0) {
+			for (unsigned y = 0; y < rows; y++) {
+				row[y][1] = (row[y][1] >> dx) | (row[y][0] << (64 - dx));
+				row[y][0] >>= dx;
+			}
+		} else if (dx < 0) {
+			for (unsigned y = 0; y < rows; y++) {
+				row[y][0] = (row[y][0] << -dx) | (row[y][1] >> (64 + dx));
+				row[y][1] <<= -dx;
+			}
+		}
+		if (!program->hires) {
+			for (unsigned y = 0; y < rows; y++) {
+				row[y][1] = 0;
+			}
+		}
+	}
+}
+
+/* Execution trace. Every opcode run by the traced interpreter appends a
+ * record to a ring mapped from a file, so the history survives a crash and
+ * costs a store per field. The ring belongs to the thread running the
+ * context; header->count is refreshed once per frame and at close.
+ */
+#define TRACE_MAGIC    0x52543843 /* "C8TR" */
+#define TRACE_VERSION  2
+#define TRACE_NO_ADDR  UINT32_MAX
+#define TRACE_REG      0x10 /* reg holds the index of the first register that changed */
+#define TRACE_REG_MORE 0x20 /* other registers changed too */
+#define TRACE_ROWS     0x80 /* count & 0x1F is sprite rows, 8 bytes apart from addr */
+#define TRACE_ROWS_TWO 0x40 /* each row also writes the next byte of its line */
+
+struct trace_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity; /* records, a power of two */
+	uint8_t mode;      /* enum chip8_mode */
+	uint8_t quirks;
+	uint16_t reserved;
+	uint64_t count;    /* records written; the ring keeps the last capacity of them */
+	uint64_t reserved2;
+};
+
+struct trace_record
+{
+	uint16_t pc;
+	uint16_t opcode;
+	uint16_t i;        /* before the opcode */
+	uint8_t reg;       /* TRACE_REG | index, 0 when no register changed */
+	uint8_t reg_value; /* new value of that register */
+	uint32_t addr;     /* first byte written, TRACE_NO_ADDR when none */
+	uint8_t value;     /* new value at addr */
+	uint8_t count;     /* bytes written from addr, 0 for 256; TRACE_ROWS for DXYN */
+	uint16_t sp;       /* after the opcode */
+};
+
+struct trace
+{
+	struct trace_header *header;
+	struct trace_record *records;
+	size_t size;
+	uint64_t mask;
+	uint64_t count;
+};
+
+#ifndef CHIP8_FUZZ
+static bool
+trace_open(struct trace *trace, char *filename, bool create, uint32_t capacity)
+{
+	memset(trace, 0, sizeof *trace);
+	int fd = create ? open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "error: cannot open %s: %s\n", filename, strerror(errno));
+		return false;
+	}
+	struct stat st;
+	if (create) {
+		trace->size = sizeof *trace->header + (size_t)capacity * sizeof *trace->records;
+		if (ftruncate(fd, (off_t)trace->size) != 0) {
+			fprintf(stderr, "error: cannot size %s: %s\n", filename, strerror(errno));
+			close(fd);
+			return false;
+		}
+	} else if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof *trace->header) {
+		fprintf(stderr, "error: %s is not a trace\n", filename);
+		close(fd);
+		return false;
+	} else {
+		trace->size = (size_t)st.st_size;
+	}
+	void *p = mmap(NULL, trace->size, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "error: cannot map %s: %s\n", filename, strerror(errno));
+		return false;
+	}
+	trace->header = p;
+	trace->records = (struct trace_record *)(trace->header + 1);
+	if (create) {
+		trace->header->magic = TRACE_MAGIC;
+		trace->header->version = TRACE_VERSION;
+		trace->header->capacity = capacity;
+	} else if (trace->header->magic != TRACE_MAGIC || trace->header->version != TRACE_VERSION ||
+		   trace->header->capacity == 0 || (trace->header->capacity & (trace->header->capacity - 1)) ||
+		   trace->size < sizeof *trace->header + (size_t)trace->header->capacity * sizeof *trace->records) {
+		fprintf(stderr, "error: %s is not a trace\n", filename);
+		munmap(p, trace->size);
+		return false;
+	}
+	trace->mask = trace->header->capacity - 1;
+	trace->count = trace->header->count;
+	return true;
+}
+
+static void
+trace_close(struct trace *trace)
+{
+	if (trace->header) {
+		munmap(trace->header, trace->size);
+		trace->header = NULL;
+	}
+}
+#endif
+
+/* Appends the record for the opcode at pc; v, i and sp are the state
+ * before it ran, which gives the changed register and the written bytes
+ * without watching every store in the interpreter.
+ */
+static void
+trace_step(struct trace *trace, struct chip8_program *program, enum chip8_quirks quirks, uint16_t pc, uint16_t raw,
+	   const uint8_t *v, uint16_t i, uint16_t sp)
+{
+	uint8_t *mem = program->mem;
+	uint8_t *now = &mem[program->v];
+	struct chip8_opcode opcode = opcode_from_bytes((uint8_t)(raw >> 8), (uint8_t)raw);
+	struct trace_record *r = &trace->records[trace->count++ & trace->mask];
+	r->pc = pc;
+	r->opcode = raw;
+	r->i = i;
+	r->sp = program->sp;
+	r->reg = 0;
+	r->reg_value = 0;
+	/* compare the registers eight at a time; the lowest set byte of the
+	 * difference is the lowest changed register on little endian hosts
+	 */
+	uint64_t before[2], after[2];
+	memcpy(before, v, sizeof before);
+	memcpy(after, now, sizeof after);
+	for (int half = 0; half < 2; half++) {
+		uint64_t diff = before[half] ^ after[half];
+		if (!diff) {
+			continue;
+		}
+		if (r->reg) {
+			r->reg |= TRACE_REG_MORE;
+			break;
+		}
+		uint8_t x = (uint8_t)(half * 8 + __builtin_ctzll(diff) / 8);
+		r->reg = TRACE_REG | x;
+		r->reg_value = now[x];
+		if (diff & (diff - 1) & ~(UINT64_C(0xFF) << (__builtin_ctzll(diff) / 8 * 8))) {
+			r->reg |= TRACE_REG_MORE;
+			break;
+		}
+	}
+
+	uint32_t addr = TRACE_NO_ADDR;
+	unsigned count = 0;
+	switch (opcode.group) {
+	case 0x0:
+		if (raw == 0x00E0 && program->mode == CHIP8_MODE_CHIP8) {
+			addr = program->bm;
+			count = 256;
+		}
+		break;
+	case 0x2:
+		if (program->sp != sp) {
+			addr = program->stack + sp;
+			count = 2;
+		}
+		break;
+	case 0x5:
+		if (program->mode == CHIP8_MODE_XOCHIP && opcode.n == 0x2) {
+			addr = i;
+			count = (unsigned)abs(opcode.vx - opcode.vy) + 1;
+		}
+		break;
+	case 0xD:
+		/* rows past the bottom are clipped or wrap like the draw does;
+		 * a row starting mid byte spills into the next one
+		 */
+		if (program->mode == CHIP8_MODE_CHIP8) {
+			bool wrap = quirks & CHIP8_QUIRK_NO_CLIPPING;
+			unsigned x0 = v[opcode.vx] % 64u;
+			unsigned y0 = v[opcode.vy] % 32u;
+			unsigned rows = wrap || y0 + opcode.n <= 32 ? opcode.n : 32 - y0;
+			if (rows) {
+				addr = program->bm + y0 * 8 + x0 / 8;
+				count = TRACE_ROWS | rows;
+				if (x0 % 8 && (x0 / 8 < 7 || wrap)) {
+					count |= TRACE_ROWS_TWO;
+				}
+			}
+		}
+		break;
+	case 0xF:
+		if (opcode.nn == 0x33) {
+			addr = i & program->mask;
+			count = 3;
+		} else if (opcode.nn == 0x55) {
+			addr = i & program->mask;
+			count = opcode.vx + 1u;
+		}
+		break;
+	}
+	r->addr = addr;
+	r->count = (uint8_t)count;
+	r->value = addr == TRACE_NO_ADDR ? 0 : mem[addr];
+}
+
+/* Debugger. Breakpoints and write watchpoints are bits per address of
+ * program->mem, so the aliased V, stack and bitmap area can be watched like
+ * any other memory. They are only looked at by the debug variant of the
+ * interpreter, which runs while a debugger is attached.
+ */
+#define DEBUG_BITMAP_WORDS ((MEMORY_SIZE + 63) / 64)
+#define DEBUG_PACKET_SIZE  0x1000
+
+struct debugger
+{
+	uint64_t breakpoints[DEBUG_BITMAP_WORDS];
+	uint64_t watchpoints[DEBUG_BITMAP_WORDS];
+	char *path;
+	int listen_fd;
+	int fd;
+	bool halted;
+	bool reported;   /* the stop reply for this halt was sent */
+	bool resume;     /* run the next opcode even if it is at a breakpoint */
+	bool stepping;
+	bool detach;
+	int signal;
+	uint32_t watch_addr;
+	size_t in_len;
+	char in[DEBUG_PACKET_SIZE];
+	char out[DEBUG_PACKET_SIZE * 2 + 8];
+};
+
+static bool
+debug_test(const uint64_t *bits, uint32_t addr)
+{
+	return addr < MEMORY_SIZE && (bits[addr / 64] >> (addr % 64) & 1);
+}
+
+static bool
+debug_watch_range(struct debugger *dbg, uint32_t addr, unsigned count)
+{
+	for (unsigned k = 0; k < count; k++) {
+		if (debug_test(dbg->watchpoints, addr + k)) {
+			dbg->watch_addr = addr + k;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void
+debug_halt(struct debugger *dbg, int signal)
+{
+	dbg->halted = true;
+	dbg->reported = false;
+	dbg->stepping = false;
+	dbg->signal = signal;
+}
+
+/* Called before each opcode by the debug variant */
+static bool
+debug_before(struct debugger *dbg, uint16_t pc)
+{
+	if (dbg->resume) {
+		dbg->resume = false;
+		return false;
+	}
+	if (debug_test(dbg->breakpoints, pc)) {
+		dbg->watch_addr = TRACE_NO_ADDR;
+		debug_halt(dbg, 5);
+		return true;
+	}
+	return false;
+}
+
+/* Offsets into the bitmap of the bytes that row r of a CHIP-8 sprite drawn
+ * at x0, y0 changes, clipped or wrapped as the draw in the interpreter does;
+ * returns how many, none for a clipped or blank row
+ */
+static unsigned
+sprite_row_bytes(uint8_t sprite, unsigned x0, unsigned y0, unsigned r, bool wrap, uint16_t bytes[2])
+{
+	unsigned y = y0 + r;
+	if (y >= 32) {
+		if (!wrap) {
+			return 0;
+		}
+		y %= 32;
+	}
+	unsigned n = 0;
+	if (sprite >> x0 % 8) {
+		bytes[n++] = (uint16_t)(y * 8 + x0 / 8);
+	}
+	if ((uint8_t)(sprite << (8 - x0 % 8)) && (x0 / 8 < 7 || wrap)) {
+		bytes[n++] = (uint16_t)(y * 8 + (x0 / 8 + 1) % 8);
+	}
+	return n;
+}
+
+/* Called after each opcode with the state from before it, see trace_step */
+static bool
+debug_after(struct debugger *dbg, struct chip8_program *program, enum chip8_quirks quirks, uint16_t raw,
+	    const uint8_t *v, uint16_t i, uint16_t sp)
+{
+	struct chip8_opcode opcode = opcode_from_bytes((uint8_t)(raw >> 8), (uint8_t)raw);
+	uint8_t *now = &program->mem[program->v];
+	bool hit = false;
+	for (uint8_t x = 0; x < 16 && !hit; x++) {
+		hit = now[x] != v[x] && debug_watch_range(dbg, program->v + x, 1);
+	}
+	if (!hit) {
+		switch (opcode.group) {
+		case 0x0:
+			hit = raw == 0x00E0 && program->mode == CHIP8_MODE_CHIP8 && debug_watch_range(dbg, program->bm, 256);
+			break;
+		case 0x2:
+			hit = program->sp != sp && debug_watch_range(dbg, program->stack + sp, 2);
+			break;
+		case 0x5:
+			hit = program->mode == CHIP8_MODE_XOCHIP && opcode.n == 0x2 &&
+			      debug_watch_range(dbg, i, (unsigned)abs(opcode.vx - opcode.vy) + 1);
+			break;
+		case 0xD:
+			for (unsigned r = 0; program->mode == CHIP8_MODE_CHIP8 && r < opcode.n && !hit; r++) {
+				uint16_t bytes[2];
+				uint8_t sprite = program->mem[(i + r) & program->mask];
+				unsigned n = sprite_row_bytes(sprite, v[opcode.vx] % 64u, v[opcode.vy] % 32u, r,
+							      quirks & CHIP8_QUIRK_NO_CLIPPING, bytes);
+				for (unsigned k = 0; k < n && !hit; k++) {
+					hit = debug_watch_range(dbg, program->bm + bytes[k], 1);
+				}
+			}
+			break;
+		case 0xF:
+			if (opcode.nn == 0x33) {
+				hit = debug_watch_range(dbg, i & program->mask, 3);
+			} else if (opcode.nn == 0x55) {
+				hit = debug_watch_range(dbg, i & program->mask, opcode.vx + 1u);
+			}
+			break;
+		}
+	}
+	if (hit) {
+		debug_halt(dbg, 5);
+		return true;
+	}
+	if (dbg->stepping) {
+		dbg->watch_addr = TRACE_NO_ADDR;
+		debug_halt(dbg, 5);
+		return true;
+	}
+	return false;
+}
+
+#ifndef CHIP8_FUZZ
+static void
+debug_set(uint64_t *bits, uint32_t addr, bool on)
+{
+	if (addr >= MEMORY_SIZE) {
+		return;
+	}
+	if (on) {
+		bits[addr / 64] |= UINT64_C(1) << (addr % 64);
+	} else {
+		bits[addr / 64] &= ~(UINT64_C(1) << (addr % 64));
+	}
+}
+
+/* GDB remote serial protocol */
+__attribute__((format(printf, 2, 3)))
+static void
+debug_send(struct debugger *dbg, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(dbg->out + 1, sizeof dbg->out - 4, fmt, ap);
+	va_end(ap);
+	if (n < 0) {
+		return;
+	}
+	if ((size_t)n > sizeof dbg->out - 5) {
+		n = (int)(sizeof dbg->out - 5);
+	}
+	uint8_t sum = 0;
+	for (int k = 1; k <= n; k++) {
+		sum = (uint8_t)(sum + dbg->out[k]);
+	}
+	dbg->out[0] = '$';
+	snprintf(dbg->out + n + 1, 4, "#%02x", sum);
+	os_write(dbg->fd, dbg->out, (size_t)n + 4);
+}
+
+static int
+hex_value(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static bool
+hex_bytes(const char *src, uint8_t *dst, size_t n)
+{
+	for (size_t k = 0; k < n; k++) {
+		int hi = hex_value(src[2 * k]);
+		int lo = hi < 0 ? -1 : hex_value(src[2 * k + 1]);
+		if (lo < 0) {
+			return false;
+		}
+		dst[k] = (uint8_t)(hi << 4 | lo);
+	}
+	return true;
+}
+
+static char *
+to_hex(char *dst, const uint8_t *src, size_t n)
+{
+	static const char digits[] = "0123456789abcdef";
+	for (size_t k = 0; k < n; k++) {
+		*dst++ = digits[src[k] >> 4];
+		*dst++ = digits[src[k] & 0xF];
+	}
+	*dst = '\0';
+	return dst;
+}
+
+/* Register numbers: 0-15 V0-VF, 16 I, 17 PC, 18 SP, 19 DT, 20 ST; I and
+ * PC are 16 bit little endian, the rest 8 bit
+ */
+#define DEBUG_REGS 21
+
+static size_t
+debug_reg_get(struct chip8_program *program, int reg, uint8_t *dst)
+{
+	if (reg < 16) {
+		dst[0] = program->mem[program->v + (unsigned)reg];
+		return 1;
+	}
+	switch (reg) {
+	case 16: dst[0] = (uint8_t)program->i;  dst[1] = (uint8_t)(program->i >> 8);  return 2;
+	case 17: dst[0] = (uint8_t)program->pc; dst[1] = (uint8_t)(program->pc >> 8); return 2;
+	case 18: dst[0] = (uint8_t)program->sp; return 1;
+	case 19: dst[0] = program->timer;       return 1;
+	case 20: dst[0] = program->sound;       return 1;
+	}
+	return 0;
+}
+
+static void
+debug_reg_set(struct chip8_program *program, int reg, const uint8_t *src)
+{
+	if (reg < 16) {
+		program->mem[program->v + (unsigned)reg] = src[0];
+		return;
+	}
+	switch (reg) {
+	case 16: program->i  = (uint16_t)((src[0] | src[1] << 8) & program->mask); break;
+	case 17: program->pc = (uint16_t)(src[0] | src[1] << 8); break;
+	case 18: program->sp = src[0] < STACK_MAX_SIZE ? src[0] : program->sp; break;
+	case 19: program->timer = src[0]; break;
+	case 20: program->sound = src[0]; break;
+	}
+}
+
+static void
+debug_target_xml(char *dst, size_t len)
+{
+	int n = snprintf(dst, len, "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+			 "<target version=\"1.0\"><feature name=\"org.chip8.core\">");
+	for (int reg = 0; reg < 16; reg++) {
+		n += snprintf(dst + n, len - (size_t)n, "<reg name=\"v%x\" bitsize=\"8\" type=\"uint8\"/>", reg);
+	}
+	snprintf(dst + n, len - (size_t)n, "<reg name=\"i\" bitsize=\"16\" type=\"data_ptr\"/>"
+		 "<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/><reg name=\"sp\" bitsize=\"8\" type=\"uint8\"/>"
+		 "<reg name=\"dt\" bitsize=\"8\" type=\"uint8\"/><reg name=\"st\" bitsize=\"8\" type=\"uint8\"/>"
+		 "</feature></target>");
+}
+
+static void
+debug_stop_reply(struct debugger *dbg)
+{
+	if (dbg->watch_addr != TRACE_NO_ADDR) {
+		debug_send(dbg, "T%02xwatch:%x;", dbg->signal, dbg->watch_addr);
+	} else {
+		debug_send(dbg, "S%02x", dbg->signal);
+	}
+	dbg->reported = true;
+}
+
+static void
+debug_packet(struct debugger *dbg, struct chip8_program *program, char *p)
+{
+	static char xml[2048];
+	uint8_t bytes[DEBUG_PACKET_SIZE / 2];
+	char hex[DEBUG_PACKET_SIZE + 1];
+	char *end;
+	unsigned long addr, len;
+
+	switch (*p) {
+	case '?':
+		debug_stop_reply(dbg);
+		return;
+	case 'g': {
+		char *dst = hex;
+		for (int reg = 0; reg < DEBUG_REGS; reg++) {
+			size_t n = debug_reg_get(program, reg, bytes);
+			dst = to_hex(dst, bytes, n);
+		}
+		debug_send(dbg, "%s", hex);
+		return;
+	}
+	case 'G': {
+		const char *src = p + 1;
+		for (int reg = 0; reg < DEBUG_REGS; reg++) {
+			uint8_t value[2];
+			size_t n = debug_reg_get(program, reg, value);
+			if (!hex_bytes(src, value, n)) {
+				debug_send(dbg, "E01");
+				return;
+			}
+			debug_reg_set(program, reg, value);
+			src += 2 * n;
+		}
+		debug_send(dbg, "OK");
+		return;
+	}
+	case 'p':
+	case 'P': {
+		long reg = strtol(p + 1, &end, 16);
+		uint8_t value[2];
+		if (reg < 0 || reg >= DEBUG_REGS) {
+			debug_send(dbg, "E01");
+			return;
+		}
+		size_t n = debug_reg_get(program, (int)reg, value);
+		if (*p == 'p') {
+			to_hex(hex, value, n);
+			debug_send(dbg, "%s", hex);
+		} else if (*end == '=' && hex_bytes(end + 1, value, n)) {
+			debug_reg_set(program, (int)reg, value);
+			debug_send(dbg, "OK");
+		} else {
+			debug_send(dbg, "E01");
+		}
+		return;
+	}
+	case 'm':
+	case 'M':
+		addr = strtoul(p + 1, &end, 16);
+		len = *end == ',' ? strtoul(end + 1, &end, 16) : 0;
+		if (addr >= MEMORY_SIZE || len > sizeof bytes || len > MEMORY_SIZE - addr) {
+			debug_send(dbg, "E01");
+		} else if (*p == 'm') {
+			to_hex(hex, &program->mem[addr], len);
+			debug_send(dbg, "%s", hex);
+		} else if (*end == ':' && hex_bytes(end + 1, &program->mem[addr], len)) {
+			debug_send(dbg, "OK");
+		} else {
+			debug_send(dbg, "E01");
+		}
+		return;
+	case 'Z':
+	case 'z': {
+		/* 0 and 1 are breakpoints, 2 write watchpoints */
+		int type = p[1] - '0';
+		addr = strtoul(p + 3, &end, 16);
+		len = *end == ',' ? strtoul(end + 1, &end, 16) : 1;
+		if (p[2] != ',' || type < 0 || type > 2 || addr >= MEMORY_SIZE || len > MEMORY_SIZE - addr) {
+			debug_send(dbg, "%s", "");
+			return;
+		}
+		if (type < 2) {
+			debug_set(dbg->breakpoints, (uint32_t)addr, *p == 'Z');
+		} else {
+			for (unsigned long k = 0; k < len; k++) {
+				debug_set(dbg->watchpoints, (uint32_t)(addr + k), *p == 'Z');
+			}
+		}
+		debug_send(dbg, "OK");
+		return;
+	}
+	case 'c':
+	case 's':
+		if (p[1]) {
+			program->pc = (uint16_t)strtoul(p + 1, NULL, 16);
+		}
+		dbg->halted = false;
+		dbg->resume = true;
+		dbg->stepping = *p == 's';
+		return;
+	case 'k':
+		Stop = 1;
+		return;
+	case 'D':
+		debug_send(dbg, "OK");
+		dbg->detach = true;
+		return;
+	case 'H':
+	case 'T':
+		debug_send(dbg, "OK");
+		return;
+	case 'q':
+		if (strncmp(p, "qSupported", 10) == 0) {
+			debug_send(dbg, "PacketSize=%x;qXfer:features:read+", DEBUG_PACKET_SIZE);
+		} else if (strncmp(p, "qXfer:features:read:target.xml:", 31) == 0) {
+			debug_target_xml(xml, sizeof xml);
+			unsigned long offset = strtoul(p + 31, &end, 16);
+			len = *end == ',' ? strtoul(end + 1, NULL, 16) : 0;
+			size_t size = strlen(xml);
+			if (offset >= size) {
+				debug_send(dbg, "l");
+			} else {
+				if (len > size - offset) {
+					len = size - offset;
+				}
+				if (len > DEBUG_PACKET_SIZE - 8) {
+					len = DEBUG_PACKET_SIZE - 8;
+				}
+				debug_send(dbg, "%c%.*s", offset + len < size ? 'm' : 'l', (int)len, xml + offset);
+			}
+		} else if (strcmp(p, "qAttached") == 0) {
+			debug_send(dbg, "1");
+		} else if (strcmp(p, "qC") == 0) {
+			debug_send(dbg, "QC1");
+		} else if (strcmp(p, "qfThreadInfo") == 0) {
+			debug_send(dbg, "m1");
+		} else if (strcmp(p, "qsThreadInfo") == 0) {
+			debug_send(dbg, "l");
+		} else {
+			debug_send(dbg, "%s", "");
+		}
+		return;
+	}
+	debug_send(dbg, "%s", "");
+}
+
+static bool
+debug_open(struct debugger *dbg, char *path)
+{
+	memset(dbg, 0, sizeof *dbg);
+	dbg->path = path;
+	dbg->fd = -1;
+	dbg->watch_addr = TRACE_NO_ADDR;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "error: socket path too long %s\n", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	dbg->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (dbg->listen_fd < 0 || bind(dbg->listen_fd, (struct sockaddr *)&addr, sizeof addr) != 0 ||
+	    listen(dbg->listen_fd, 1) != 0) {
+		fprintf(stderr, "error: cannot listen on %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	fprintf(stderr, "waiting for gdb on %s\n", path);
+	dbg->fd = accept(dbg->listen_fd, NULL, NULL);
+	if (dbg->fd < 0) {
+		fprintf(stderr, "error: accept on %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	/* like gdbserver the program waits for the first continue */
+	debug_halt(dbg, 5);
+	dbg->reported = true;
+	return true;
+}
+
+static void
+debug_close(struct debugger *dbg)
+{
+	if (dbg->fd >= 0) {
+		debug_send(dbg, "W00");
+		close(dbg->fd);
+	}
+	close(dbg->listen_fd);
+	unlink(dbg->path);
+}
+
+/* Drops the client; breakpoints go with it so the program runs on */
+static void
+debug_detach(struct debugger *dbg)
+{
+	close(dbg->fd);
+	dbg->fd = -1;
+	dbg->halted = false;
+	memset(dbg->breakpoints, 0, sizeof dbg->breakpoints);
+	memset(dbg->watchpoints, 0, sizeof dbg->watchpoints);
+}
+
+/* Sends the stop reply for a new halt and handles whatever the client has
+ * sent; with block it waits until the program is resumed. Returns false
+ * once the client is gone, and the program then runs on undisturbed.
+ */
+static bool
+debug_poll(struct debugger *dbg, struct chip8_program *program, bool block)
+{
+	if (dbg->halted && !dbg->reported) {
+		debug_stop_reply(dbg);
+	}
+	for (;;) {
+		struct pollfd pfd = { .fd = dbg->fd, .events = POLLIN };
+		int ready = poll(&pfd, 1, block && dbg->halted && !Stop ? 100 : 0);
+		if (ready < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ready <= 0) {
+			if (block && dbg->halted && !Stop) {
+				continue;
+			}
+			return true;
+		}
+		ssize_t r = read(dbg->fd, dbg->in + dbg->in_len, sizeof dbg->in - dbg->in_len - 1);
+		if (r <= 0) {
+			debug_detach(dbg);
+			return false;
+		}
+		dbg->in_len += (size_t)r;
+		dbg->in[dbg->in_len] = '\0';
+
+		char *p = dbg->in;
+		char *last = dbg->in + dbg->in_len;
+		while (p < last) {
+			if (*p == 0x03) {
+				/* interrupt from the client */
+				dbg->watch_addr = TRACE_NO_ADDR;
+				debug_halt(dbg, 2);
+				debug_stop_reply(dbg);
+				++p;
+				continue;
+			}
+			if (*p != '$') {
+				++p;
+				continue;
+			}
+			char *hash = memchr(p, '#', (size_t)(last - p));
+			if (!hash || last - hash < 3) {
+				break;
+			}
+			*hash = '\0';
+			os_write(dbg->fd, "+", 1);
+			debug_packet(dbg, program, p + 1);
+			if (dbg->detach) {
+				debug_detach(dbg);
+				return false;
+			}
+			p = hash + 3;
+		}
+		dbg->in_len = (size_t)(last - p);
+		memmove(dbg->in, p, dbg->in_len);
+		if (dbg->in_len >= sizeof dbg->in - 1) {
+			dbg->in_len = 0;
+		}
+	}
+}
+#endif
+
+/* -seed makes runs repeatable, e.g. for comparing headless audio dumps */
+static uint8_t
+chip8_random(struct chip8_context *context)
+{
+	if (!context->rng) {
+		return (uint8_t)arc4random_uniform(256);
+	}
+	uint32_t x = context->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	context->rng = x;
+	return (uint8_t)(x >> 24);
+}
+
+/* Drops the cached decodes of both opcodes that can cover a byte the
+ * program writes
+ */
+static inline void
+chip8_decoded_drop(struct chip8_decoded *decoded, uint16_t addr, uint16_t mask)
+{
+	decoded[addr].valid = false;
+	decoded[(addr - 1) & mask].valid = false;
+}
+
+/* Variants of the interpreter; each is a separate copy of the loop so the
+ * plain one carries no instrumentation at all
+ */
+enum chip8_variant
+{
+	CHIP8_VARIANT_PLAIN = 0x0,
+	CHIP8_VARIANT_TRACE     = 0x1,
+	CHIP8_VARIANT_DEBUG     = 0x2,
+	CHIP8_VARIANT_PREDECODE = 0x4  /* CHIP8_ENGINE_PREDECODE */
+};
+
+static inline __attribute__((always_inline)) int
+chip8_exec_frame_variant(struct chip8_context *context, struct keypad *keypad, int64_t time_now, unsigned variant)
+{
+	struct chip8_program *program = context->program;
+	enum chip8_quirks quirks = context->quirks;
+	uint8_t *mem = program->mem;
+	uint8_t *stack = &mem[program->stack];
+	uint8_t *bitmap = &mem[program->bm];
 	uint8_t *v = &mem[program->v];
+	uint16_t mask = program->mask;
+	bool extended = program->mode != CHIP8_MODE_CHIP8;
+	bool xochip = program->mode == CHIP8_MODE_XOCHIP;
+	uint16_t last_pc;
+	uint16_t temp;
+	uint16_t skip;
+	bool sprite_drawn = false;
+	int executed = 0;
+	uint8_t saved_v[16];
+	uint16_t saved_opcode = 0;
+	uint16_t saved_i = 0;
+	uint16_t saved_sp = 0;
+
+	for (int i = 0; i < context->opcodes_per_frame; i++) {
+		last_pc = program->pc;
+
+		if (program->pc < 0x1FC || program->pc + 1 > program->top) {
+			context->fault = CHIP8_FAULT_PC;
+			Dump = 1;
+			Stop = 1;
+			break;
+		}
+
+		struct chip8_opcode opcode;
+		if (variant & CHIP8_VARIANT_PREDECODE) {
+			struct chip8_decoded *decoded = &context->decoded[program->pc];
+			if (!decoded->valid) {
+				decoded->opcode = opcode_from_bytes(mem[program->pc], mem[program->pc+1]);
+				decoded->valid = true;
+			}
+			opcode = decoded->opcode;
+		} else {
+			opcode = opcode_from_bytes(mem[program->pc], mem[program->pc+1]);
+		}
+		/* XO-CHIP skips step over the whole of a 4 byte F000 NNNN */
+		skip = 4;
+		if (xochip && mem[program->pc+2] == 0xF0 && mem[program->pc+3] == 0x00) {
+			skip = 6;
+		}
+		if ((variant & CHIP8_VARIANT_DEBUG) && debug_before(context->debug, program->pc)) {
+			break;
+		}
+		if (variant & (CHIP8_VARIANT_TRACE | CHIP8_VARIANT_DEBUG)) {
+			memcpy(saved_v, v, sizeof saved_v);
+			saved_opcode = (uint16_t)(mem[program->pc] << 8 | mem[program->pc+1]);
+			saved_i = program->i;
+			saved_sp = program->sp;
+		}
+		switch (opcode.group) {
+		case 0x0:
+			switch (opcode.nnn) {
+			case 0xE0:
+				if (extended) {
+					display_clear(program, program->planes);
+				} else {
+					memset(&mem[program->bm], 0, 256);
+				}
+				program->pc += 2;
+				break;
+			case 0xEE:
+				if (program->sp < 2) {
+					context->fault = CHIP8_FAULT_STACK_UNDERFLOW;
+					Dump = 1;
+					Stop = 1;
+					break;
+				}
+				program->pc = (stack[program->sp-2] << 8 | stack[program->sp-1]) & 0xFFFF;
+				program->sp -= 2;
+				break;
+			case 0xFB:
+			case 0xFC:
+				if (extended) {
+					display_scroll(program, opcode.nnn == 0xFB ? 4 : -4, 0);
+				}
+				program->pc += 2;
+				break;
+			case 0xFD:
+				if (extended) {
+					if (variant & CHIP8_VARIANT_TRACE) {
+						trace_step(context->trace, program, quirks, last_pc, saved_opcode, saved_v, saved_i, saved_sp);
+					}
+					Stop = 1;
+					return executed + 1;
+				}
+				program->pc += 2;
+				break;
+			case 0xFE:
+			case 0xFF:
+				if (extended) {
+					program->hires = opcode.nnn == 0xFF;
+					display_clear(program, 3);
+				}
+				program->pc += 2;
+				break;
+			default:
+				if (extended && (opcode.nnn & 0xFF0) == 0x0C0) {
+					display_scroll(program, 0, opcode.n);
+				} else if (xochip && (opcode.nnn & 0xFF0) == 0x0D0) {
+					display_scroll(program, 0, -opcode.n);
+				}
+				/* RCA 1802 subroutines (0NNN) */
+				program->pc += 2;
+				break;
+			}
+			break;
+		case 0x1:
+			program->pc = opcode.nnn;
+			break;
+		case 0x2:
+			if (program->sp + 2 > STACK_MAX_SIZE) {
+				context->fault = CHIP8_FAULT_STACK_OVERFLOW;
+				Dump = 1;
+				Stop = 1;
+				break;
+			}
+			stack[program->sp + 0] = ((program->pc + 2) >> 8);
+			stack[program->sp + 1] = ((program->pc + 2) & 0xFF);
+			program->sp += 2;
+			program->pc = opcode.nnn;
+			break;
+		case 0x3:
+			program->pc += v[opcode.vx] == opcode.nn ? skip : 2;
+			break;
+		case 0x4:
+			program->pc += v[opcode.vx] != opcode.nn ? skip : 2;
+			break;
+		case 0x5:
+			if (xochip && (opcode.n == 0x2 || opcode.n == 0x3)) {
+				/* save or load VX..VY, in either order, without moving I */
+				int step = opcode.vx <= opcode.vy ? 1 : -1;
+				for (int r = opcode.vx, k = 0;; r += step, k++) {
+					if (opcode.n == 0x2) {
+						mem[(program->i + k) & mask] = v[r];
+						if (variant & CHIP8_VARIANT_PREDECODE) {
+							chip8_decoded_drop(context->decoded, (program->i + k) & mask, mask);
+						}
+					} else {
+						v[r] = mem[(program->i + k) & mask];
+					}
+					if (r == opcode.vy) {
+						break;
+					}
+				}
+				program->pc += 2;
+				break;
+			}
+			program->pc += v[opcode.vx] == v[opcode.vy] ? skip : 2;
+			break;
+		case 0x6:
+			v[opcode.vx] = opcode.nn;
+			program->pc += 2;
+			break;
+		case 0x7:
+			v[opcode.vx] += opcode.nn;
+			program->pc += 2;
+			break;
+		case 0x8:
+			switch (opcode.n) {
+			case 0x0:
+				v[opcode.vx] = v[opcode.vy];
+				program->pc += 2;
+				break;
+			case 0x1:
+				v[opcode.vx] |= v[opcode.vy];
+				if (quirks & CHIP8_QUIRK_RESET_VF) {
+					v[0xF] = 0;
+				}
+				program->pc += 2;
+				break;
+			case 0x2:
+				v[opcode.vx] &= v[opcode.vy];
+				if (quirks & CHIP8_QUIRK_RESET_VF) {
+					v[0xF] = 0;
+				}
+				program->pc += 2;
+				break;
+			case 0x3:
+				v[opcode.vx] ^= v[opcode.vy];
+				if (quirks & CHIP8_QUIRK_RESET_VF) {
+					v[0xF] = 0;
+				}
+				program->pc += 2;
+				break;
+			case 0x4:
+				temp = v[opcode.vx] + v[opcode.vy];
+				v[opcode.vx] = temp & 0xFF;
+				/* flag is 1 on overflow */
+				v[0xF] = !!(temp & 0xFF00);
+				program->pc += 2;
+				break;
+			case 0x5:
+				temp = v[opcode.vx] - v[opcode.vy];
+				v[opcode.vx] = temp & 0xFF;
+				/* flag is 1 on no borrow */
+				v[0xF] = !((temp & 0x8000) >> 15);
+				program->pc += 2;
+				break;
+			case 0x6:
+				temp = (quirks & CHIP8_QUIRK_SHIFT_VX) ? v[opcode.vx] : v[opcode.vy];
+				v[opcode.vx] = (temp >> 1) & 0xFF;
+				v[0xF] = temp & 1;
+				program->pc += 2;
+				break;
+			case 0x7:
+				temp = v[opcode.vy] - v[opcode.vx];
+				v[opcode.vx] = temp & 0xFF;
+				/* flag is 1 on no borrow */
+				v[0xF] = !((temp & 0x8000) >> 15);
+				program->pc += 2;
+				break;
+			case 0xE:
+				temp = (quirks & CHIP8_QUIRK_SHIFT_VX) ? v[opcode.vx] : v[opcode.vy];
+				v[opcode.vx] = (temp << 1) & 0xFF;
+				v[0xF] = (temp & 0x80) >> 7;
+				program->pc += 2;
+				break;
+			}
+			break;
+		case 0x9:
+			program->pc += v[opcode.vx] != v[opcode.vy] ? skip : 2;
+			break;
+		case 0xA:
+			program->i = opcode.nnn;
+			program->pc += 2;
+			break;
+		case 0xB:
+			if (quirks & CHIP8_QUIRK_JUMP_FROM_X) {
+				program->pc = opcode.nnn + v[opcode.vx];
+			} else {
+				program->pc = opcode.nnn + v[0];
+			}
+			break;
+		case 0xC:
+			v[opcode.vx] = chip8_random(context) & opcode.nn;
+			program->pc += 2;
+			break;
+		case 0xD: {
+			if (extended) {
+				bool wrap = quirks & CHIP8_QUIRK_NO_CLIPPING;
+				v[0xF] = display_draw(program, v[opcode.vx], v[opcode.vy], opcode.n, wrap);
+				sprite_drawn = true;
+				program->pc += 2;
+				break;
+			}
+			uint8_t x0 = v[opcode.vx] % 64;
+			uint8_t y0 = v[opcode.vy] % 32;
+			v[0xF] = 0;
+			for (uint8_t y = 0; y < opcode.n; y++) {
+				uint8_t yc = y0 + y;
+				if (yc >= 32) {
+					if (quirks & CHIP8_QUIRK_NO_CLIPPING) {
+						yc %= 32;
+					} else {
+						break;
+					}
+				}
+				uint8_t sprite = mem[(program->i + y) & mask];
+				for (uint8_t sprite_mask = 1 << 7, x = 0; sprite_mask != 0; sprite_mask >>= 1, x++) {
+					if (!(sprite & sprite_mask)) {
+						continue;
+					}
+					uint8_t xc = x0 + x;
+					if (xc >= 64) {
+						if (quirks & CHIP8_QUIRK_NO_CLIPPING) {
+							xc %= 64;
+						} else {
+							break;
+						}
+					}
+					uint16_t byte = (yc * 64 + xc) / 8;
+					uint8_t byte_mask = (1 << (7 - xc % 8)) & 0xFF;
+					v[0xF] |= !!(bitmap[byte] & byte_mask);
+					bitmap[byte] ^= byte_mask;
+					sprite_drawn = true;
+				}
+			}
+			program->pc += 2;
+			break;
+		}
+		case 0xE:
+			switch (opcode.nn) {
+			case 0x9E:
+				program->pc += (keypad->down & (1 << (v[opcode.vx] & 0xF))) ? skip : 2;
+				break;
+			case 0xA1:
+				program->pc += (keypad->down & (1 << (v[opcode.vx] & 0xF))) ? 2 : skip;
+				break;
+			}
+			break;
+		case 0xF:
+			switch (opcode.nn) {
+			/* opcodes a mode does not have are left to the halt check below */
+			case 0x00:
+				if (xochip && opcode.vx == 0) {
+					program->i = (mem[program->pc+2] << 8 | mem[program->pc+3]) & 0xFFFF;
+					program->pc += 4;
+				}
+				break;
+			case 0x01:
+				if (xochip) {
+					program->planes = opcode.vx & 0x3;
+					program->pc += 2;
+				}
+				break;
+			case 0x02:
+				if (xochip && opcode.vx == 0) {
+					for (uint8_t x = 0; x < 16; x++) {
+						program->pattern[x] = mem[(program->i + x) & mask];
+					}
+					program->pattern_loaded = 1;
+					program->pc += 2;
+				}
+				break;
+			case 0x07:
+				v[opcode.vx] = program->timer;
+				program->pc += 2;
+				break;
+			case 0x0A:
+				if (keypad->held_key != UCHAR_MAX) {
+					if (keypad->down & (1 << keypad->held_key)) {
+						keypad->held_key_time = time_now;
+					} else if (time_now - keypad->held_key_time > INT64_C(1000000) * context->keypad_response_time) {
+						keypad->held_key = UCHAR_MAX;
+						program->pc += 2;
+					}
+				} else if (keypad->down) {
+					keypad->held_key = __builtin_ctz(keypad->down) & 0xF;
+					keypad->held_key_time = time_now;
+					v[opcode.vx] = keypad->held_key;
+				}
+				break;
+			case 0x15:
+				program->timer = v[opcode.vx];
+				program->pc += 2;
+				break;
+			case 0x18:
+				program->sound = v[opcode.vx];
+				program->pc += 2;
+				break;
+			case 0x1E:
+				/* font data starts at mem[0] */
+				program->i = (program->i + v[opcode.vx]) & mask;
+				program->pc += 2;
+				break;
+			case 0x29:
+				program->i = ((v[opcode.vx] & 0xF) * 5) & mask;
+				program->pc += 2;
+				break;
+			case 0x30:
+				if (extended) {
+					program->i = (0x50 + (v[opcode.vx] & 0xF) * 10) & mask;
+					program->pc += 2;
+				}
+				break;
+			case 0x3A:
+				if (xochip) {
+					program->pitch = v[opcode.vx];
+					program->pc += 2;
+				}
+				break;
+			case 0x33:
+				mem[(program->i + 0) & mask] = v[opcode.vx] / 100;
+				mem[(program->i + 1) & mask] = v[opcode.vx] / 10 % 10;
+				mem[(program->i + 2) & mask] = v[opcode.vx] % 10;
+				if (variant & CHIP8_VARIANT_PREDECODE) {
+					for (uint16_t k = 0; k < 3; k++) {
+						chip8_decoded_drop(context->decoded, (program->i + k) & mask, mask);
+					}
+				}
+				program->pc += 2;
+				break;
+			case 0x55:
+				for (uint8_t x = 0; x <= opcode.vx; x++) {
+					mem[(program->i + x) & mask] = v[x];
+					if (variant & CHIP8_VARIANT_PREDECODE) {
+						chip8_decoded_drop(context->decoded, (program->i + x) & mask, mask);
+					}
+				}
+				if (quirks & CHIP8_QUIRK_INCREMENT_I) {
+					program->i = (program->i + opcode.vx + 1) & mask;
+				}
+				program->pc += 2;
+				break;
+			case 0x65:
+				for (uint8_t x = 0; x <= opcode.vx; x++) {
+					v[x] = mem[(program->i + x) & mask];
+				}
+				if (quirks & CHIP8_QUIRK_INCREMENT_I) {
+					program->i = (program->i + opcode.vx + 1) & mask;
+				}
+				program->pc += 2;
+				break;
+			case 0x75:
+			case 0x85:
+				if (extended) {
+					/* SCHIP has 8 flag registers, XO-CHIP 16 */
+					uint8_t count = (uint8_t)(xochip ? opcode.vx : opcode.vx & 0x7);
+					for (uint8_t x = 0; x <= count; x++) {
+						if (opcode.nn == 0x75) {
+							program->flags[x] = v[x];
+						} else {
+							v[x] = program->flags[x];
+						}
+					}
+					program->pc += 2;
+				}
+				break;
+			}
+			break;
+		}
+
+		if (variant & CHIP8_VARIANT_TRACE) {
+			trace_step(context->trace, program, quirks, last_pc, saved_opcode, saved_v, saved_i, saved_sp);
+		}
+		if ((variant & CHIP8_VARIANT_DEBUG) &&
+		    debug_after(context->debug, program, quirks, saved_opcode, saved_v, saved_i, saved_sp)) {
+			executed++;
+			break;
+		}
+		executed++;
+
+		if ((quirks & CHIP8_QUIRK_VBLANK_WAIT) && sprite_drawn) {
+			break;
+		}
+
+		if (last_pc == program->pc) {
+			bool wait = opcode.group == 0xF && opcode.nn == 0x0A;
+			bool halt = opcode.group == 0x1 && opcode.nnn == program->pc;
+			if (!(wait || halt)) {
+				if (!context->fault) {
+					context->fault = CHIP8_FAULT_LOOP;
+				}
+				Dump = 1;
+				Stop = 1;
+			}
+			break;
+		}
+	}
+	return executed;
+}
+
+/* Runs at most context->opcodes_per_frame opcodes and returns how many were executed. */
+static int
+chip8_exec_frame(struct chip8_context *context, struct keypad *keypad, int64_t time_now)
+{
+	int executed;
+	/* tracing and debugging always use the switch engine */
+	switch ((context->trace ? CHIP8_VARIANT_TRACE : 0) | (context->debug ? CHIP8_VARIANT_DEBUG : 0)) {
+	case CHIP8_VARIANT_PLAIN:
+		if (context->engine == CHIP8_ENGINE_PREDECODE) {
+			return chip8_exec_frame_variant(context, keypad, time_now, CHIP8_VARIANT_PREDECODE);
+		}
+		return chip8_exec_frame_variant(context, keypad, time_now, CHIP8_VARIANT_PLAIN);
+	case CHIP8_VARIANT_DEBUG:
+		return chip8_exec_frame_variant(context, keypad, time_now, CHIP8_VARIANT_DEBUG);
+	case CHIP8_VARIANT_TRACE:
+		executed = chip8_exec_frame_variant(context, keypad, time_now, CHIP8_VARIANT_TRACE);
+		break;
+	default:
+		executed = chip8_exec_frame_variant(context, keypad, time_now, CHIP8_VARIANT_TRACE | CHIP8_VARIANT_DEBUG);
+		break;
+	}
+	context->trace->header->count = context->trace->count;
+	return executed;
+}
+
+/* Offline trace analysis */
+struct trace_filter
+{
+	int pc;       /* only this PC, -1 for any */
+	int write;    /* only opcodes writing this address, -1 for any */
+	char *grep;   /* only opcodes whose disassembly contains this */
+	int last;     /* only the last N matches, 0 for all */
+};
+
+#ifndef CHIP8_FUZZ
+static void
+trace_print_record(struct out_buffer *out, uint64_t seq, struct trace_record *r, char mark)
+{
+	char str[24];
+	if (!opcode_to_string(str, sizeof str, opcode_from_bytes((uint8_t)(r->opcode >> 8), (uint8_t)r->opcode))) {
+		snprintf(str, sizeof str, "?");
+	}
+	out_printf(out, "%c%10llu %03x: %04x %-18s i=%03x sp=%02x", mark, (unsigned long long)seq, r->pc, r->opcode, str, r->i, r->sp);
+	if (r->reg) {
+		out_printf(out, " %%%x=%02x%s", r->reg & 0xF, r->reg_value, (r->reg & TRACE_REG_MORE) ? "+" : "");
+	}
+	if (r->addr != TRACE_NO_ADDR) {
+		out_printf(out, " [%03x]=%02x", r->addr, r->value);
+		if (r->count & TRACE_ROWS) {
+			out_printf(out, " x%u rows%s", r->count & 0x1F, (r->count & TRACE_ROWS_TWO) ? " of 2" : "");
+		} else if (r->count != 1) {
+			out_printf(out, " x%u", r->count ? r->count : 256);
+		}
+	}
+	out_printf(out, "\n");
+}
+
+/* Whether the opcode of r wrote addr. Sprite rows wrap within the
+ * bitmap, which is 256 byte aligned.
+ */
+static bool
+trace_wrote(struct trace_record *r, uint32_t addr)
+{
+	if (r->addr == TRACE_NO_ADDR) {
+		return false;
+	}
+	if (!(r->count & TRACE_ROWS)) {
+		return addr >= r->addr && addr - r->addr < (r->count ? r->count : 256u);
+	}
+	uint32_t base = r->addr - r->addr % 256;
+	for (unsigned row = 0; row < (r->count & 0x1Fu); row++) {
+		uint32_t line = base + (r->addr + row * 8) % 256 / 8 * 8;
+		if (addr == line + r->addr % 8 ||
+		    ((r->count & TRACE_ROWS_TWO) && addr == line + (r->addr + 1) % 8)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool
+trace_match(struct trace_record *r, struct trace_filter *filter)
+{
+	if (filter->pc >= 0 && r->pc != filter->pc) {
+		return false;
+	}
+	if (filter->write >= 0 && !trace_wrote(r, (uint32_t)filter->write)) {
+		return false;
+	}
+	if (filter->grep) {
+		char str[24];
+		if (!opcode_to_string(str, sizeof str, opcode_from_bytes((uint8_t)(r->opcode >> 8), (uint8_t)r->opcode)) ||
+		    !strstr(str, filter->grep)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static uint64_t
+trace_first(struct trace *trace)
+{
+	return trace->count > trace->mask ? trace->count - trace->mask - 1 : 0;
+}
+
+static int
+trace_print(char *filename, struct trace_filter *filter)
+{
+	struct trace trace;
+	if (!trace_open(&trace, filename, false, 0)) {
+		return 1;
+	}
+	struct out_buffer out = { .file = stdout, .len = 0 };
+	uint64_t first = trace_first(&trace);
+	if (filter->last) {
+		/* walk back to the start of the last N matches */
+		uint64_t seq = trace.count;
+		int found = 0;
+		while (seq > first && found < filter->last) {
+			--seq;
+			found += trace_match(&trace.records[seq & trace.mask], filter);
+		}
+		first = seq;
+	}
+	for (uint64_t seq = first; seq < trace.count; seq++) {
+		struct trace_record *r = &trace.records[seq & trace.mask];
+		if (trace_match(r, filter)) {
+			trace_print_record(&out, seq, r, ' ');
+		}
+	}
+	out_flush(&out);
+	trace_close(&trace);
+	return 0;
+}
+
+/* Prints where two traces of the same program first part, with the
+ * opcodes leading up to it; exits 1 if they differ
+ */
+static int
+trace_diff(char *a_name, char *b_name)
+{
+	struct trace a, b;
+	if (!trace_open(&a, a_name, false, 0)) {
+		return 1;
+	}
+	if (!trace_open(&b, b_name, false, 0)) {
+		trace_close(&a);
+		return 1;
+	}
+	struct out_buffer out = { .file = stdout, .len = 0 };
+	uint64_t first = trace_first(&a) > trace_first(&b) ? trace_first(&a) : trace_first(&b);
+	uint64_t end = a.count < b.count ? a.count : b.count;
+	int status = 0;
+	uint64_t seq;
+	for (seq = first; seq < end; seq++) {
+		if (memcmp(&a.records[seq & a.mask], &b.records[seq & b.mask], sizeof *a.records) != 0) {
+			break;
+		}
+	}
+	if (seq < end) {
+		uint64_t from = seq - first > 16 ? seq - 16 : first;
+		for (uint64_t k = from; k < seq; k++) {
+			trace_print_record(&out, k, &a.records[k & a.mask], ' ');
+		}
+		trace_print_record(&out, seq, &a.records[seq & a.mask], '<');
+		trace_print_record(&out, seq, &b.records[seq & b.mask], '>');
+		status = 1;
+	} else if (a.count != b.count) {
+		out_printf(&out, "traces agree up to %llu, %s has %llu records and %s %llu\n",
+			   (unsigned long long)end, a_name, (unsigned long long)a.count, b_name, (unsigned long long)b.count);
+		status = 1;
+	}
+	out_flush(&out);
+	trace_close(&a);
+	trace_close(&b);
+	return status;
+}
+
+/* Adjusts opcodes_per_frame so the time spent in chip8_exec_frame stays within
+ * cpu_share percent of the frame. Decreases take effect immediately so an
+ * overrunning instance backs off within one frame; increases are damped.
+ */
+static void
+governor_update(struct chip8_context *context, int executed, int64_t busy)
+{
+	struct chip8_governor *governor = &context->governor;
+	if (!governor->start) {
+		governor->start = os_get_time() - busy;
+	}
+	governor->opcodes += executed;
+	governor->busy += busy;
+	if (executed <= 0) {
+		return;
+	}
+
+	int64_t cost = busy * 256 / executed;
+	if (!governor->opcode_cost) {
+		governor->opcode_cost = cost;
+	} else {
+		governor->opcode_cost += (cost - governor->opcode_cost) / 8;
+	}
+	if (governor->opcode_cost < 1) {
+		governor->opcode_cost = 1;
+	}
+
+	int64_t budget = FRAME_TIME_NS * governor->cpu_share / 100;
+	int64_t want = budget * 256 / governor->opcode_cost;
+	int64_t next = context->opcodes_per_frame;
+	if (want < next) {
+		next = want;
+	} else if (want > next) {
+		next += (want - next + 3) / 4;
+	}
+	if (next > governor->opcodes_max) {
+		next = governor->opcodes_max;
+	}
+	if (next < governor->opcodes_min) {
+		next = governor->opcodes_min;
+	}
+	context->opcodes_per_frame = (int)next;
+}
+
+static void
+governor_report(FILE *dst, struct chip8_context *context)
+{
+	struct chip8_governor *governor = &context->governor;
+	int64_t elapsed = os_get_time() - governor->start;
+	if (!governor->start || elapsed <= 0) {
+		return;
+	}
+	fprintf(dst, "governor: %lld opcodes/s (target %lld), %d opcodes/frame, %lld%% cpu\n",
+		(long long)(governor->opcodes * INT64_C(1000000000) / elapsed),
+		(long long)governor->opcodes_max * 60,
+		context->opcodes_per_frame,
+		(long long)(governor->busy * 100 / elapsed));
+}
+
+/* Shared memory export of the presented frame. Readers copy the frame
+ * between two loads of sequence and retry if it was odd or changed, so
+ * the writer never waits for them and any number can attach.
+ */
+#define SHM_MAGIC   0x4D533843 /* "C8SM" */
+#define SHM_VERSION 1
+
+struct shm_frame
+{
+	uint32_t magic;
+	uint32_t version;
+	_Atomic uint32_t sequence; /* odd while the writer is updating */
+	uint8_t mode;              /* enum chip8_mode */
+	uint8_t hires;
+	uint16_t reserved;
+	uint64_t frame;            /* frames presented since start */
+	uint8_t bitmap[256];       /* CHIP-8 bitmap at program->bm */
+	struct chip8_display display;
+};
+
+struct shm_export
+{
+	struct shm_frame *frame;
+	char *name;
+};
+
+static bool
+shm_export_open(struct shm_export *shm, char *name)
+{
+	shm->name = name;
+	/* exclusive, so a second instance cannot wipe or unlink a live export */
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0 && errno == EEXIST) {
+		fprintf(stderr, "error: shared memory %s is already in use; if no instance is exporting it, "
+			"remove it (on Linux /dev/shm%s)\n", name, name);
+		return false;
+	}
+	if (fd < 0) {
+		fprintf(stderr, "error: cannot create shared memory %s: %s\n", name, strerror(errno));
+		return false;
+	}
+	if (ftruncate(fd, sizeof *shm->frame) != 0) {
+		fprintf(stderr, "error: cannot size shared memory %s: %s\n", name, strerror(errno));
+		close(fd);
+		return false;
+	}
+	void *p = mmap(NULL, sizeof *shm->frame, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "error: cannot map shared memory %s: %s\n", name, strerror(errno));
+		return false;
+	}
+	shm->frame = p;
+	memset(shm->frame, 0, sizeof *shm->frame);
+	shm->frame->magic = SHM_MAGIC;
+	shm->frame->version = SHM_VERSION;
+	return true;
+}
+
+static void
+shm_export_close(struct shm_export *shm)
+{
+	munmap(shm->frame, sizeof *shm->frame);
+	shm_unlink(shm->name);
+}
+
+static void
+shm_export_publish(struct shm_export *shm, struct chip8_program *program)
+{
+	struct shm_frame *frame = shm->frame;
+	uint32_t sequence = atomic_load_explicit(&frame->sequence, memory_order_relaxed);
+	atomic_store_explicit(&frame->sequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	frame->mode = program->mode;
+	frame->hires = program->hires;
+	frame->frame++;
+	memcpy(frame->bitmap, &program->mem[program->bm], sizeof frame->bitmap);
+	if (program->mode != CHIP8_MODE_CHIP8) {
+		frame->display = program->display;
+	}
+	atomic_store_explicit(&frame->sequence, sequence + 2, memory_order_release);
+}
+
+/* Frame capture to a file or pipe. Frames are rendered into a pool and
+ * written CAPTURE_BATCH at a time with one writev. Y4M is grayscale at
+ * scale pixels per hires pixel; raw is a 4 byte little endian frame
+ * number followed by the packed 1 bpp screen, 64x32 for CHIP-8 and 128x64
+ * otherwise. With dedup an unchanged frame is not rendered again: Y4M
+ * points the next iovec at the previous frame so the timing is kept, raw
+ * leaves it out and the frame numbers show the gap.
+ */
+#define CAPTURE_BATCH 32
+
+enum capture_format
+{
+	CAPTURE_RAW,
+	CAPTURE_Y4M
+};
+
+struct capture
+{
+	int fd;
+	enum capture_format format;
+	bool dedup;
+	unsigned scale;
+	unsigned width;
+	unsigned height;
+	size_t frame_size;
+	uint8_t *pool;                    /* CAPTURE_BATCH rendered frames */
+	uint8_t numbers[CAPTURE_BATCH][4];
+	struct iovec iov[2 * CAPTURE_BATCH];
+	int niov;
+	int used;                         /* pool slots holding this batch */
+	int last;                         /* slot of the previous frame, -1 when none */
+	uint8_t previous[sizeof(struct chip8_display) + 1];
+	uint32_t frame;
+	uint64_t skipped;
+	bool failed;                      /* a write failed; nothing more is written */
+};
+
+static char Y4mFrame[] = "FRAME\n";
+
+static enum capture_format
+capture_format_from_filename(char *filename)
+{
+	char *ext = strrchr(filename, '.');
+	return ext && strcmp(ext, ".y4m") == 0 ? CAPTURE_Y4M : CAPTURE_RAW;
+}
+
+static bool
+capture_open(struct capture *capture, char *filename, enum capture_format format, unsigned scale, bool dedup,
+	     enum chip8_mode mode)
+{
+	memset(capture, 0, sizeof *capture);
+	capture->format = format;
+	capture->dedup = dedup;
+	capture->scale = scale;
+	capture->last = -1;
+	if (capture->format == CAPTURE_Y4M) {
+		capture->width = 128 * scale;
+		capture->height = 64 * scale;
+		capture->frame_size = (size_t)capture->width * capture->height;
+	} else {
+		capture->frame_size = mode == CHIP8_MODE_CHIP8 ? 256 : 1024;
+	}
+
+	capture->fd = strcmp(filename, "-") == 0 ? STDOUT_FILENO : open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (capture->fd < 0) {
+		fprintf(stderr, "error: cannot open %s: %s\n", filename, strerror(errno));
+		return false;
+	}
+	capture->pool = malloc(CAPTURE_BATCH * capture->frame_size);
+	if (!capture->pool) {
+		fprintf(stderr, "error: out of memory for capture\n");
+		return false;
+	}
+	if (capture->format == CAPTURE_Y4M) {
+		char header[64];
+		int n = snprintf(header, sizeof header, "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 Cmono\n",
+				 capture->width, capture->height);
+		os_write(capture->fd, header, (size_t)n);
+	}
+	return true;
+}
+
+static void
+capture_flush(struct capture *capture)
+{
+	struct iovec *iov = capture->iov;
+	int niov = capture->niov;
+	while (niov) {
+		ssize_t r = writev(capture->fd, iov, niov);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "error: capture stopped, cannot write: %s\n", strerror(errno));
+			capture->failed = true;
+			break;
+		}
+		/* drop the fully written entries and trim a partial one */
+		size_t done = (size_t)r;
+		while (niov && done >= iov->iov_len) {
+			done -= iov->iov_len;
+			++iov;
+			--niov;
+		}
+		if (niov) {
+			iov->iov_base = (char *)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+	capture->niov = 0;
+
+	/* the previous frame stays available for dedup in slot 0 */
+	if (capture->dedup && capture->last > 0) {
+		memcpy(capture->pool, capture->pool + (size_t)capture->last * capture->frame_size, capture->frame_size);
+		capture->last = 0;
+	}
+	capture->used = capture->dedup && capture->last >= 0 ? 1 : 0;
+}
+
+static void
+capture_render_y4m(struct capture *capture, struct chip8_program *program, uint8_t *dst)
+{
+	static const uint8_t gray[4] = { 0x00, 0xFF, 0x80, 0xC0 };
+	bool chip8 = program->mode == CHIP8_MODE_CHIP8;
+	unsigned cols = chip8 || !program->hires ? 64 : 128;
+	unsigned rows = cols / 2;
+	unsigned scale = capture->width / cols;
+	uint8_t *bitmap = &program->mem[program->bm];
+	for (unsigned y = 0; y < rows; y++) {
+		uint8_t *line = dst + (size_t)y * scale * capture->width;
+		for (unsigned x = 0; x < cols; x++) {
+			unsigned value = chip8 ? (unsigned)(bitmap[y * 8 + x / 8] >> (7 - x % 8)) & 1 : display_pixel(&program->display, x, y);
+			memset(line + x * scale, gray[value], scale);
+		}
+		for (unsigned k = 1; k < scale; k++) {
+			memcpy(line + (size_t)k * capture->width, line, capture->width);
+		}
+	}
+}
+
+static void
+capture_render_raw(struct chip8_program *program, uint8_t *dst)
+{
+	if (program->mode == CHIP8_MODE_CHIP8) {
+		memcpy(dst, &program->mem[program->bm], 256);
+		return;
+	}
+	for (unsigned y = 0; y < 64; y++) {
+		for (unsigned x = 0; x < 128; x += 8) {
+			uint8_t byte = 0;
+			for (unsigned k = 0; k < 8; k++) {
+				unsigned px = program->hires ? x + k : (x + k) / 2;
+				unsigned py = program->hires ? y : y / 2;
+				byte = (uint8_t)(byte << 1 | !!display_pixel(&program->display, px, py));
+			}
+			dst[y * 16 + x / 8] = byte;
+		}
+	}
+}
+
+static void
+capture_frame(struct capture *capture, struct chip8_program *program)
+{
+	if (capture->failed) {
+		return;
+	}
+	uint32_t frame = capture->frame++;
+	if (capture->dedup) {
+		uint8_t state[sizeof capture->previous];
+		if (program->mode == CHIP8_MODE_CHIP8) {
+			memset(state, 0, sizeof state);
+			memcpy(state, &program->mem[program->bm], 256);
+		} else {
+			memcpy(state, &program->display, sizeof program->display);
+			state[sizeof program->display] = program->hires;
+		}
+		if (capture->last >= 0 && memcmp(state, capture->previous, sizeof state) == 0) {
+			capture->skipped++;
+			if (capture->format == CAPTURE_Y4M) {
+				capture->iov[capture->niov++] = (struct iovec){ Y4mFrame, sizeof Y4mFrame - 1 };
+				capture->iov[capture->niov++] = (struct iovec){
+					capture->pool + (size_t)capture->last * capture->frame_size, capture->frame_size };
+			}
+			goto done;
+		}
+		memcpy(capture->previous, state, sizeof state);
+	}
+
+	uint8_t *dst = capture->pool + (size_t)capture->used * capture->frame_size;
+	if (capture->format == CAPTURE_Y4M) {
+		capture_render_y4m(capture, program, dst);
+		capture->iov[capture->niov++] = (struct iovec){ Y4mFrame, sizeof Y4mFrame - 1 };
+	} else {
+		uint8_t *number = capture->numbers[capture->used];
+		put_le(number, frame, 4);
+		capture_render_raw(program, dst);
+		capture->iov[capture->niov++] = (struct iovec){ number, 4 };
+	}
+	capture->iov[capture->niov++] = (struct iovec){ dst, capture->frame_size };
+	capture->last = capture->used++;
+
+done:
+	if (capture->used == CAPTURE_BATCH || capture->niov == 2 * CAPTURE_BATCH) {
+		capture_flush(capture);
+	}
+}
+
+/* Returns false if the capture stopped early */
+static bool
+capture_close(struct capture *capture)
+{
+	if (!capture->failed) {
+		capture_flush(capture);
+	}
+	if (capture->fd != STDOUT_FILENO) {
+		close(capture->fd);
+	}
+	free(capture->pool);
+	if (capture->skipped) {
+		fprintf(stderr, "capture: %u frames, %llu unchanged\n", capture->frame, (unsigned long long)capture->skipped);
+	}
+	return !capture->failed;
+}
+
+static uint64_t
+rom_hash(uint8_t *data, size_t size)
+{
+	/* FNV-1a */
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * UINT64_C(0x100000001b3);
+	}
+	return hash;
+}
+
+/* Drops every cached decode, after memory changed outside the engine */
+static void
+chip8_decoded_clear(struct chip8_context *context)
+{
+	if (context->decoded) {
+		memset(context->decoded, 0, 0x10000 * sizeof *context->decoded);
+	}
+}
+
+/* Differential execution. The switch interpreter runs as the reference
+ * with the engine under test as a shadow on its own copy of the program;
+ * both get the same keys, random numbers and timer values. After every
+ * frame the register, memory and display hashes are compared, and on the
+ * first difference the frame is replayed one opcode at a time from a
+ * snapshot to find the opcode where the engines part.
+ */
+#define LOCKSTEP_HISTORY 16
+
+struct lockstep
+{
+	struct chip8_context shadow;
+	struct chip8_program *snapshot[2]; /* reference and shadow at the start of the frame */
+	uint64_t frame;
+	uint32_t seed;
+	uint32_t rng;                      /* random state at the start of the frame */
+	bool diverged;
+	char **argv;                       /* command line for the reproduce hint, NULL unless headless */
+	int argc;
+	int skip[2];                       /* argv index of -frames and -seed, 0 when not given */
+};
+
+struct chip8_hashes
+{
+	uint64_t regs;
+	uint64_t mem;
+	uint64_t display;
+};
+
+static struct chip8_hashes
+chip8_hash(struct chip8_program *program)
+{
+	/* everything but mem and display, which may hold stale bytes past len */
+	uint8_t regs[32 + 32];
+	size_t n = 0;
+	regs[n++] = (uint8_t)program->pc;
+	regs[n++] = (uint8_t)(program->pc >> 8);
+	regs[n++] = (uint8_t)program->i;
+	regs[n++] = (uint8_t)(program->i >> 8);
+	regs[n++] = (uint8_t)program->sp;
+	regs[n++] = program->timer;
+	regs[n++] = program->sound;
+	regs[n++] = program->hires;
+	regs[n++] = program->planes;
+	regs[n++] = program->pitch;
+	regs[n++] = program->pattern_loaded;
+	memcpy(regs + n, program->flags, sizeof program->flags);
+	n += sizeof program->flags;
+	memcpy(regs + n, program->pattern, sizeof program->pattern);
+	n += sizeof program->pattern;
+	memcpy(regs + n, &program->mem[program->v], 16);
+	n += 16;
+	size_t mem_size = program->mode == CHIP8_MODE_XOCHIP ? MEMORY_SIZE : 0x1000;
+	return (struct chip8_hashes){
+		.regs    = rom_hash(regs, n),
+		.mem     = rom_hash(program->mem, mem_size),
+		.display = rom_hash((uint8_t *)&program->display, sizeof program->display)
+	};
+}
+
+static bool
+lockstep_same(struct chip8_program *a, struct chip8_program *b)
+{
+	struct chip8_hashes ha = chip8_hash(a);
+	struct chip8_hashes hb = chip8_hash(b);
+	return ha.regs == hb.regs && ha.mem == hb.mem && ha.display == hb.display;
+}
+
+static bool
+lockstep_open(struct lockstep *ls, struct chip8_context *context, enum chip8_engine engine)
+{
+	memset(ls, 0, sizeof *ls);
+	ls->shadow = (struct chip8_context){
+		.program = malloc(sizeof *context->program),
+		.opcodes_per_frame = context->opcodes_per_frame,
+		.keypad_response_time = context->keypad_response_time,
+		.quirks = context->quirks,
+		.engine = engine
+	};
+	ls->snapshot[0] = malloc(sizeof *context->program);
+	ls->snapshot[1] = malloc(sizeof *context->program);
+	if (!ls->shadow.program || !ls->snapshot[0] || !ls->snapshot[1] ||
+	    (engine == CHIP8_ENGINE_PREDECODE && !(ls->shadow.decoded = calloc(0x10000, sizeof *ls->shadow.decoded)))) {
+		fprintf(stderr, "error: out of memory for lockstep\n");
+		return false;
+	}
+	*ls->shadow.program = *context->program;
+	/* both engines must draw the same random numbers; keep the seed in
+	 * the range -seed accepts
+	 */
+	if (!context->rng) {
+		context->rng = (arc4random() & INT32_MAX) | 1;
+	}
+	ls->seed = context->rng;
+	ls->shadow.rng = context->rng;
+	return true;
+}
+
+static void
+lockstep_close(struct lockstep *ls)
+{
+	free(ls->shadow.program);
+	free(ls->shadow.decoded);
+	free(ls->snapshot[0]);
+	free(ls->snapshot[1]);
+}
+
+static void
+lockstep_print_state(struct out_buffer *out, const char *name, struct chip8_program *program)
+{
+	struct chip8_hashes h = chip8_hash(program);
+	uint8_t *v = &program->mem[program->v];
+	out_printf(out, "  %-9s pc=%03x i=%03x sp=%02x v=", name, program->pc, program->i, program->sp);
+	for (int x = 0; x < 16; x++) {
+		out_printf(out, "%02x", v[x]);
+	}
+	out_printf(out, " regs=%016llx mem=%016llx display=%016llx\n",
+		   (unsigned long long)h.regs, (unsigned long long)h.mem, (unsigned long long)h.display);
+}
+
+/* Prints word so a shell reads it back unchanged */
+static void
+out_shell_word(struct out_buffer *out, const char *word)
+{
+	if (*word && strspn(word, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_./=+,:@%") == strlen(word)) {
+		out_printf(out, "%s", word);
+		return;
+	}
+	out_printf(out, "'");
+	for (const char *p = word; *p; p++) {
+		if (*p == '\'') {
+			out_printf(out, "'\\''");
+		} else {
+			out_printf(out, "%c", *p);
+		}
+	}
+	out_printf(out, "'");
+}
+
+/* Replays the frame from the snapshots one opcode at a time and prints
+ * the opcodes up to the first one after which the engines differ
+ */
+static void
+lockstep_report(struct lockstep *ls, struct chip8_context *context, struct keypad *keypad, int64_t time_now, int executed)
+{
+	static struct chip8_program reference;
+	struct chip8_context ref = *context;
+	struct chip8_context shadow = ls->shadow;
+	struct keypad keys[2] = { *keypad, *keypad };
+	struct { uint16_t pc, opcode; } history[LOCKSTEP_HISTORY];
+	struct out_buffer out = { .file = stderr, .len = 0 };
+	int steps = 0;
+
+	reference = *ls->snapshot[0];
+	*shadow.program = *ls->snapshot[1];
+	chip8_decoded_clear(&shadow);
+	ref.program = &reference;
+	ref.trace = NULL;
+	ref.audio = NULL;
+	ref.engine = CHIP8_ENGINE_SWITCH;
+	ref.opcodes_per_frame = 1;
+	ref.rng = ls->rng;
+	shadow.opcodes_per_frame = 1;
+	shadow.rng = ls->rng;
+
+	out_printf(&out, "lockstep: %s diverges from switch in frame %llu (seed %u)\n",
+		   EngineNames[shadow.engine], (unsigned long long)ls->frame, ls->seed);
+	bool found = false;
+	for (; steps < executed && !found; steps++) {
+		uint16_t pc = reference.pc;
+		history[steps % LOCKSTEP_HISTORY].pc = pc;
+		history[steps % LOCKSTEP_HISTORY].opcode = (uint16_t)(reference.mem[pc] << 8 | reference.mem[(pc + 1) & 0xFFFF]);
+		chip8_exec_frame(&ref, &keys[0], time_now);
+		chip8_exec_frame(&shadow, &keys[1], time_now);
+		found = !lockstep_same(&reference, shadow.program);
+	}
+	int first = steps > LOCKSTEP_HISTORY ? steps - LOCKSTEP_HISTORY : 0;
+	for (int k = first; k < steps; k++) {
+		char str[24];
+		uint16_t opcode = history[k % LOCKSTEP_HISTORY].opcode;
+		if (!opcode_to_string(str, sizeof str, opcode_from_bytes((uint8_t)(opcode >> 8), (uint8_t)opcode))) {
+			snprintf(str, sizeof str, "?");
+		}
+		out_printf(&out, "%c %03x: %04x %s\n", found && k == steps - 1 ? '>' : ' ',
+			   history[k % LOCKSTEP_HISTORY].pc, opcode, str);
+	}
+	if (found) {
+		out_printf(&out, "  after opcode %d of the frame\n", steps);
+		lockstep_print_state(&out, "switch", &reference);
+		lockstep_print_state(&out, EngineNames[shadow.engine], shadow.program);
+		for (uint32_t addr = 0; addr < MEMORY_SIZE; addr++) {
+			if (reference.mem[addr] != shadow.program->mem[addr]) {
+				out_printf(&out, "  first memory difference at %03x: %02x != %02x\n",
+					   addr, reference.mem[addr], shadow.program->mem[addr]);
+				break;
+			}
+		}
+	} else {
+		out_printf(&out, "  the frame does not diverge when run one opcode at a time\n");
+		lockstep_print_state(&out, "switch", context->program);
+		lockstep_print_state(&out, EngineNames[shadow.engine], ls->shadow.program);
+	}
+	/* only headless runs are deterministic: interactive ones take keys,
+	 * tick the timers from the clock and may be governed
+	 */
+	if (ls->argv) {
+		out_printf(&out, "  reproduce with ");
+		out_shell_word(&out, ls->argv[0]);
+		out_printf(&out, " -frames %llu -seed %u", (unsigned long long)ls->frame + 1, ls->seed);
+		for (int k = 1; k < ls->argc; k++) {
+			if (k == ls->skip[0] || k == ls->skip[1]) {
+				k++;
+				continue;
+			}
+			out_printf(&out, " ");
+			out_shell_word(&out, ls->argv[k]);
+		}
+		out_printf(&out, "\n");
+	} else {
+		out_printf(&out, "  interactive runs cannot be replayed; use -frames for a run that can\n");
+	}
+	out_flush(&out);
+}
+
+static int
+lockstep_frame(struct chip8_context *context, struct keypad *keypad, int64_t time_now)
+{
+	struct lockstep *ls = context->lockstep;
+	struct chip8_program *shadow = ls->shadow.program;
+	struct keypad shadow_keypad = *keypad;
+
+	/* the timers are ticked outside the engines, so they are shared */
+	shadow->timer = context->program->timer;
+	shadow->sound = context->program->sound;
+	ls->shadow.opcodes_per_frame = context->opcodes_per_frame;
+	*ls->snapshot[0] = *context->program;
+	*ls->snapshot[1] = *shadow;
+	ls->rng = context->rng;
+	struct keypad start = *keypad;
+
+	int executed = chip8_exec_frame(context, keypad, time_now);
+	chip8_exec_frame(&ls->shadow, &shadow_keypad, time_now);
+	if (!lockstep_same(context->program, shadow)) {
+		lockstep_report(ls, context, &start, time_now, executed);
+		ls->diverged = true;
+		Stop = 1;
+	}
+	ls->frame++;
+	return executed;
+}
+
+/* Runs one frame on the selected engine, checked against the reference
+ * in lockstep mode
+ */
+static int
+chip8_run_frame(struct chip8_context *context, struct keypad *keypad, int64_t time_now)
+{
+	if (context->lockstep) {
+		return lockstep_frame(context, keypad, time_now);
+	}
+	return chip8_exec_frame(context, keypad, time_now);
+}
+
+/* Hands a finished frame to the exporters */
+static void
+chip8_present(struct chip8_context *context)
+{
+	if (context->shm) {
+		shm_export_publish(context->shm, context->program);
+	}
+	if (context->capture) {
+		capture_frame(context->capture, context->program);
+	}
+}
+
+/* One 60 Hz tick of the delay and sound timers */
+static void
+chip8_tick(struct chip8_context *context)
+{
+	struct chip8_program *program = context->program;
+	if (program->timer) {
+		--program->timer;
+	}
+	if (context->audio) {
+		audio_generate(context->audio, program);
+	} else if (program->sound && !context->headless) {
+		os_beep();
+	}
+	if (program->sound) {
+		--program->sound;
+	}
+}
+
+static void
+chip8_exec(struct chip8_context *context)
+{
+	struct chip8_program *program = context->program;
+	uint8_t *mem = program->mem;
 	struct keypad keypad = { .time = {0}, .down = 0, .up = 0xFFFF, .held_key = UCHAR_MAX, .held_key_time = 0 };
-	uint16_t last_pc;
-	uint16_t temp;
 	int64_t timer_last = os_get_time();
 	int64_t timer_accumulator = 0;
 
@@ -460,304 +3483,83 @@ chip8_exec(struct chip8_context *context)
 		}
 
 		int64_t time_now = os_get_time();
-		bool sprite_drawn = false;
-
-		for (int i = 0; i < context->opcodes_per_frame; i++) {
-			last_pc = program->pc;
-
-			if (program->pc < 0x1FC || program->pc + 1 > 0xE9F) {
-				Dump = 1;
-				Stop = 1;
-				break;
-			}
-
-			struct chip8_opcode opcode = opcode_from_bytes(mem[program->pc], mem[program->pc+1]);
-			switch (opcode.group) {
-			case 0x0:
-				switch (opcode.nnn) {
-				case 0xE0:
-					memset(&mem[program->bm], 0, 256);
-					program->pc += 2;
-					break;
-				case 0xEE:
-					if (program->sp < 2) {
-						Dump = 1;
-						Stop = 1;
-						break;
-					}
-					program->pc = (stack[program->sp-2] << 8 | stack[program->sp-1]) & 0xFFFF;
-					program->sp -= 2;
-					break;
-				default:
-					/* RCA 1802 subroutines (0NNN) */
-					program->pc += 2;
-					break;
-				}
-				break;
-			case 0x1:
-				program->pc = opcode.nnn;
-				break;
-			case 0x2:
-				if (program->sp + 2 > STACK_MAX_SIZE) {
-					Dump = 1;
-					Stop = 1;
-					break;
-				}
-				stack[program->sp + 0] = ((program->pc + 2) >> 8);
-				stack[program->sp + 1] = ((program->pc + 2) & 0xFF);
-				program->sp += 2;
-				program->pc = opcode.nnn;
-				break;
-			case 0x3:
-				program->pc += v[opcode.vx] == opcode.nn ? 4 : 2;
-				break;
-			case 0x4:
-				program->pc += v[opcode.vx] != opcode.nn ? 4 : 2;
-				break;
-			case 0x5:
-				program->pc += v[opcode.vx] == v[opcode.vy] ? 4 : 2;
-				break;
-			case 0x6:
-				v[opcode.vx] = opcode.nn;
-				program->pc += 2;
-				break;
-			case 0x7:
-				v[opcode.vx] += opcode.nn;
-				program->pc += 2;
-				break;
-			case 0x8:
-				switch (opcode.n) {
-				case 0x0:
-					v[opcode.vx] = v[opcode.vy];
-					program->pc += 2;
-					break;
-				case 0x1:
-					v[opcode.vx] |= v[opcode.vy];
-					if (quirks & CHIP8_QUIRK_RESET_VF) {
-						v[0xF] = 0;
-					}
-					program->pc += 2;
-					break;
-				case 0x2:
-					v[opcode.vx] &= v[opcode.vy];
-					if (quirks & CHIP8_QUIRK_RESET_VF) {
-						v[0xF] = 0;
-					}
-					program->pc += 2;
-					break;
-				case 0x3:
-					v[opcode.vx] ^= v[opcode.vy];
-					if (quirks & CHIP8_QUIRK_RESET_VF) {
-						v[0xF] = 0;
-					}
-					program->pc += 2;
-					break;
-				case 0x4:
-					temp = v[opcode.vx] + v[opcode.vy];
-					v[opcode.vx] = temp & 0xFF;
-					/* flag is 1 on overflow */
-					v[0xF] = !!(temp & 0xFF00);
-					program->pc += 2;
-					break;
-				case 0x5:
-					temp = v[opcode.vx] - v[opcode.vy];
-					v[opcode.vx] = temp & 0xFF;
-					/* flag is 1 on no borrow */
-					v[0xF] = !((temp & 0x8000) >> 15);
-					program->pc += 2;
-					break;
-				case 0x6:
-					temp = (quirks & CHIP8_QUIRK_SHIFT_VX) ? v[opcode.vx] : v[opcode.vy];
-					v[opcode.vx] = (temp >> 1) & 0xFF;
-					v[0xF] = temp & 1;
-					program->pc += 2;
-					break;
-				case 0x7:
-					temp = v[opcode.vy] - v[opcode.vx];
-					v[opcode.vx] = temp & 0xFF;
-					/* flag is 1 on no borrow */
-					v[0xF] = !((temp & 0x8000) >> 15);
-					program->pc += 2;
-					break;
-				case 0xE:
-					temp = (quirks & CHIP8_QUIRK_SHIFT_VX) ? v[opcode.vx] : v[opcode.vy];
-					v[opcode.vx] = (temp << 1) & 0xFF;
-					v[0xF] = (temp & 0x80) >> 7;
-					program->pc += 2;
-					break;
-				}
-				break;
-			case 0x9:
-				program->pc += v[opcode.vx] != v[opcode.vy] ? 4 : 2;
-				break;
-			case 0xA:
-				program->i = opcode.nnn;
-				program->pc += 2;
-				break;
-			case 0xB:
-				if (quirks & CHIP8_QUIRK_JUMP_FROM_X) {
-					program->pc = opcode.nnn + v[opcode.vx];
-				} else {
-					program->pc = opcode.nnn + v[0];
-				}
-				break;
-			case 0xC:
-				v[opcode.vx] = arc4random_uniform(256) & opcode.nn;
-				program->pc += 2;
-				break;
-			case 0xD: {
-				uint8_t x0 = v[opcode.vx] % 64;
-				uint8_t y0 = v[opcode.vy] % 32;
-				v[0xF] = 0;
-				for (uint8_t y = 0; y < opcode.n; y++) {
-					uint8_t yc = y0 + y;
-					if (yc >= 32) {
-						if (quirks & CHIP8_QUIRK_NO_CLIPPING) {
-							yc %= 32;
-						} else {
-							break;
-						}
-					}
-					uint8_t sprite = mem[(program->i + y) & 0xFFF];
-					for (uint8_t sprite_mask = 1 << 7, x = 0; sprite_mask != 0; sprite_mask >>= 1, x++) {
-						if (!(sprite & sprite_mask)) {
-							continue;
-						}
-						uint8_t xc = x0 + x;
-						if (xc >= 64) {
-							if (quirks & CHIP8_QUIRK_NO_CLIPPING) {
-								xc %= 64;
-							} else {
-								break;
-							}
-						}
-						uint16_t byte = (yc * 64 + xc) / 8;
-						uint8_t byte_mask = (1 << (7 - xc % 8)) & 0xFF;
-						v[0xF] |= !!(bitmap[byte] & byte_mask);
-						bitmap[byte] ^= byte_mask;
-						sprite_drawn = true;
-					}
-				}
-				program->pc += 2;
-				break;
-			}
-			case 0xE:
-				switch (opcode.nn) {
-				case 0x9E:
-					program->pc += (keypad.down & (1 << (v[opcode.vx] & 0xF))) ? 4 : 2;
-					break;
-				case 0xA1:
-					program->pc += (keypad.down & (1 << (v[opcode.vx] & 0xF))) ? 2 : 4;
-					break;
-				}
-				break;
-			case 0xF:
-				switch (opcode.nn) {
-				case 0x07:
-					v[opcode.vx] = program->timer;
-					program->pc += 2;
-					break;
-				case 0x0A:
-					if (keypad.held_key != UCHAR_MAX) {
-						if (keypad.down & (1 << keypad.held_key)) {
-							keypad.held_key_time = time_now;
-						} else if (time_now - keypad.held_key_time > INT64_C(1000000) * context->keypad_response_time) {
-							keypad.held_key = UCHAR_MAX;
-							program->pc += 2;
-						}
-					} else if (keypad.down) {
-						keypad.held_key = __builtin_ctz(keypad.down) & 0xF;
-						keypad.held_key_time = time_now;
-						v[opcode.vx] = keypad.held_key;
-					}
-					break;
-				case 0x15:
-					program->timer = v[opcode.vx];
-					program->pc += 2;
-					break;
-				case 0x18:
-					program->sound = v[opcode.vx];
-					program->pc += 2;
-					break;
-				case 0x1E:
-					/* font data starts at mem[0] */
-					program->i = (program->i + v[opcode.vx]) & 0xFFF;
-					program->pc += 2;
-					break;
-				case 0x29:
-					program->i = ((v[opcode.vx] & 0xF) * 5) & 0xFFF;
-					program->pc += 2;
-					break;
-				case 0x33:
-					mem[(program->i + 0) & 0xFFF] = v[opcode.vx] / 100;
-					mem[(program->i + 1) & 0xFFF] = v[opcode.vx] / 10 % 10;
-					mem[(program->i + 2) & 0xFFF] = v[opcode.vx] % 10;
-					program->pc += 2;
-					break;
-				case 0x55:
-					for (uint8_t x = 0; x <= opcode.vx; x++) {
-						mem[(program->i + x) & 0xFFF] = v[x];
-					}
-					if (quirks & CHIP8_QUIRK_INCREMENT_I) {
-						program->i = (program->i + opcode.vx + 1) & 0xFFF;
-					}
-					program->pc += 2;
-					break;
-				case 0x65:
-					for (uint8_t x = 0; x <= opcode.vx; x++) {
-						v[x] = mem[(program->i + x) & 0xFFF];
-					}
-					if (quirks & CHIP8_QUIRK_INCREMENT_I) {
-						program->i = (program->i + opcode.vx + 1) & 0xFFF;
-					}
-					program->pc += 2;
-					break;
-				}
-				break;
-			}
-
-			if ((quirks & CHIP8_QUIRK_VBLANK_WAIT) && sprite_drawn) {
-				break;
-			}
-
-			if (last_pc == program->pc) {
-				bool wait = opcode.group == 0xF && opcode.nn == 0x0A;
-				bool halt = opcode.group == 0x1 && opcode.nnn == program->pc;
-				if (!(wait || halt)) {
-					Dump = 1;
-					Stop = 1;
-				}
-				break;
+		bool halted = context->debug && context->debug->halted;
+		if (!halted) {
+			int executed = chip8_run_frame(context, &keypad, time_now);
+			if (context->governor.cpu_share) {
+				governor_update(context, executed, os_get_time() - time_now);
 			}
 		}
 
 		int64_t timer_now = os_get_time();
 		timer_accumulator += timer_now - timer_last;
 		timer_last = timer_now;
-		while (timer_accumulator >= INT64_C(16666667)) {
-			timer_accumulator -= INT64_C(16666667);
-			if (program->timer) {
-				--program->timer;
-			}
-			if (program->sound) {
-				os_beep();
-				--program->sound;
-			}
+		if (halted) {
+			/* the timers stop with the program */
+			timer_accumulator = 0;
+		}
+		while (timer_accumulator >= FRAME_TIME_NS) {
+			timer_accumulator -= FRAME_TIME_NS;
+			chip8_tick(context);
 		}
 
 		os_wait_frame(time_now);
-		os_bit_blit(&mem[program->bm]);
+		if (program->mode == CHIP8_MODE_CHIP8) {
+			os_bit_blit(&mem[program->bm]);
+		} else {
+			os_display_blit(program);
+		}
+		chip8_present(context);
 		update_keypad(&keypad, os_get_time(), context->keypad_response_time);
+		if (context->debug && !debug_poll(context->debug, program, false)) {
+			/* the debugger may have written memory */
+			context->debug = NULL;
+			chip8_decoded_clear(context);
+		}
 	}
 }
 
-static bool
-chip8_init(struct chip8_program *program, uint8_t *data, size_t size)
+/* Runs a fixed number of frames as fast as possible without the terminal.
+ * Each frame is exactly one timer tick and no keys are ever pressed, so
+ * together with -seed the output is the same on every run.
+ */
+static void
+chip8_exec_headless(struct chip8_context *context, int frames)
 {
-	if (size > PROGRAM_MAX_SIZE) {
-		return false;
+	struct keypad keypad = { .time = {0}, .down = 0, .up = 0xFFFF, .held_key = UCHAR_MAX, .held_key_time = 0 };
+
+	context->headless = true;
+	for (int frame = 0; frame < frames; frame++) {
+		if (Dump) {
+			chip8_dump(stderr, context->program, true);
+			Dump = 0;
+		}
+		if (context->debug && !debug_poll(context->debug, context->program, true)) {
+			context->debug = NULL;
+			chip8_decoded_clear(context);
+		}
+		if (Stop) {
+			break;
+		}
+		chip8_run_frame(context, &keypad, frame * FRAME_TIME_NS);
+		chip8_tick(context);
+		chip8_present(context);
+		if (context->audio) {
+			while (audio_drain(context->audio)) {
+			}
+		}
 	}
+	if (Dump) {
+		chip8_dump(stderr, context->program, true);
+		Dump = 0;
+	}
+}
+#endif
 
+/* The state of a machine before any program is loaded */
+static void
+chip8_template(struct chip8_program *program, enum chip8_mode mode)
+{
 	/* only required when may want a full memory dump; avoids
 	 * parsing uninitialized memory as opcodes at end of program
 	 */
@@ -769,33 +3571,152 @@ chip8_init(struct chip8_program *program, uint8_t *data, size_t size)
 	 * V registers, stack, and bitmap are aliased in mem[] at 0xEF0, 0xEA0, and
 	 * 0xF00 respectively. This is intentional and matches the COSMAC VIP layout.
 	 * A ROM writing to high addresses via the I register can corrupt emulator state.
+	 *
+	 * XO-CHIP programs may use all 64 KB, so the same block is moved past the
+	 * end of the address space where I cannot reach it. SCHIP keeps the VIP
+	 * layout; its screen lives in program->display instead of the bitmap.
 	 */
-	uint16_t font_offset   = 0x000;
-	uint16_t boot_offset   = 0x1FC;
-	uint16_t prog_offset   = 0x200;
-	uint16_t stack_offset  = 0xEA0;
-	uint16_t reg_offset    = 0xEF0;
-	uint16_t bitmap_offset = 0xF00;
+	uint32_t system_offset   = mode == CHIP8_MODE_XOCHIP ? 0x10000 : 0xEA0;
+	uint16_t font_offset     = 0x000;
+	uint16_t big_font_offset = 0x050;
+	uint16_t boot_offset     = 0x1FC;
+	uint32_t stack_offset    = system_offset;
+	uint32_t reg_offset      = system_offset + 0x50;
+	uint32_t bitmap_offset   = system_offset + 0x60;
 	memcpy(program->mem + font_offset, Fonts, sizeof Fonts);
-	memcpy(program->mem + prog_offset, data, size);
-	program->pc    = boot_offset;
-	program->stack = stack_offset;
-	program->v     = reg_offset;
-	program->bm    = bitmap_offset;
-	program->len   = (uint16_t)size;
-	program->i     = 0;
-	program->sound = 0;
-	program->timer = 0;
-	program->sp    = 0;
+	memcpy(program->mem + big_font_offset, BigFonts, sizeof BigFonts);
+	program->pc     = boot_offset;
+	program->stack  = stack_offset;
+	program->v      = reg_offset;
+	program->bm     = bitmap_offset;
+	program->len    = 0;
+	program->mask   = mode == CHIP8_MODE_XOCHIP ? 0xFFFF : 0xFFF;
+	program->top    = mode == CHIP8_MODE_XOCHIP ? 0xFFFF : 0xE9F;
+	program->mode   = (uint8_t)mode;
+	program->planes = 1;
+	program->pitch  = 64;
+	program->i      = 0;
+	program->sound  = 0;
+	program->timer  = 0;
+	program->sp     = 0;
 	/* Boot sequence: CLS (00E0) then JP 0x200 (1200) to program start.
 	 * JP replaces the COSMAC VIP SYS call (004B) which was a no-op. */
 	program->mem[boot_offset + 0] = 0x00;
 	program->mem[boot_offset + 1] = 0xE0;
 	program->mem[boot_offset + 2] = 0x12;
 	program->mem[boot_offset + 3] = 0x00;
+}
+
+/* Resets program from a template built on first use, so repeated loads
+ * such as fuzzing copy 4 KB instead of clearing the whole struct. Outside
+ * XO-CHIP nothing past 0xFFF is ever read, so that is all that is copied.
+ */
+static bool
+chip8_init(struct chip8_program *program, uint8_t *data, size_t size, enum chip8_mode mode)
+{
+	static struct chip8_program templates[3];
+	static bool ready[3];
+
+	if (size > (mode == CHIP8_MODE_XOCHIP ? XOCHIP_MAX_SIZE : PROGRAM_MAX_SIZE)) {
+		return false;
+	}
+	if (!ready[mode]) {
+		chip8_template(&templates[mode], mode);
+		ready[mode] = true;
+	}
+	size_t used = mode == CHIP8_MODE_XOCHIP ? sizeof *program : offsetof(struct chip8_program, mem) + 0x1000;
+	memcpy(program, &templates[mode], used);
+	memcpy(program->mem + 0x200, data, size);
+	program->len = (uint16_t)size;
 	return true;
 }
-
+
+static const char *
+chip8_fault_name(enum chip8_fault fault)
+{
+	switch (fault) {
+	case CHIP8_FAULT_NONE:            return "none";
+	case CHIP8_FAULT_STACK_UNDERFLOW: return "stack underflow";
+	case CHIP8_FAULT_STACK_OVERFLOW:  return "stack overflow";
+	case CHIP8_FAULT_PC:              return "pc out of range";
+	case CHIP8_FAULT_LOOP:            return "unexpected self-loop";
+	}
+	return "unknown";
+}
+
+#ifdef CHIP8_FUZZ
+/* libFuzzer entry point, see make fuzz. Each input is a CHIP-8 ROM run
+ * headless for at most FUZZ_FRAMES frames of FUZZ_OPCODES opcodes with no
+ * keys pressed. The fault paths are the normal outcome for random bytes,
+ * so they are only counted, and reported at exit; the classes named in
+ * CHIP8_FUZZ_FAULTS (stack, pc, loop) abort instead so the fuzzer keeps
+ * the input as a finding. Code only the command line frontend uses is
+ * left out of this build.
+ */
+#define FUZZ_FRAMES  16
+#define FUZZ_OPCODES 256
+
+static unsigned FuzzFindings;
+static uint64_t FuzzCounts[16];
+
+static void
+fuzz_report(void)
+{
+	for (unsigned fault = 1; fault < 16; fault <<= 1) {
+		fprintf(stderr, "chip8: %s %llu\n", chip8_fault_name((enum chip8_fault)fault), (unsigned long long)FuzzCounts[fault]);
+	}
+}
+
+int
+LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	(void)argc;
+	(void)argv;
+	char *faults = getenv("CHIP8_FUZZ_FAULTS");
+	if (faults) {
+		FuzzFindings |= strstr(faults, "stack") ? CHIP8_FAULT_STACK_UNDERFLOW | CHIP8_FAULT_STACK_OVERFLOW : 0;
+		FuzzFindings |= strstr(faults, "pc") ? CHIP8_FAULT_PC : 0;
+		FuzzFindings |= strstr(faults, "loop") ? CHIP8_FAULT_LOOP : 0;
+	}
+	atexit(fuzz_report);
+	return 0;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static struct chip8_program program;
+	struct keypad keypad = { .time = {0}, .down = 0, .up = 0xFFFF, .held_key = UCHAR_MAX, .held_key_time = 0 };
+	struct chip8_context context = {
+		.program = &program,
+		.opcodes_per_frame = FUZZ_OPCODES,
+		.keypad_response_time = 150,
+		.quirks = CHIP8_QUIRK_SHIFT_VX,
+		.rng = 1
+	};
+
+	if (!chip8_init(&program, (uint8_t *)data, size, CHIP8_MODE_CHIP8)) {
+		return -1;
+	}
+	Stop = 0;
+	Dump = 0;
+	for (int frame = 0; frame < FUZZ_FRAMES && !Stop; frame++) {
+		chip8_exec_frame(&context, &keypad, frame * FRAME_TIME_NS);
+		if (program.timer) {
+			--program.timer;
+		}
+		if (program.sound) {
+			--program.sound;
+		}
+	}
+	FuzzCounts[context.fault]++;
+	if (context.fault & FuzzFindings) {
+		fprintf(stderr, "chip8: %s at %03x\n", chip8_fault_name(context.fault), program.pc);
+		abort();
+	}
+	return 0;
+}
+#else
 static void
 os_signal_handler(int signal)
 {
@@ -809,13 +3730,19 @@ os_signal_handler(int signal)
 	}
 }
 
-static struct termios
-os_init(void)
+static void
+os_init_signals(void)
 {
 	signal(SIGHUP, os_signal_handler);
 	signal(SIGINT, os_signal_handler);
 	signal(SIGQUIT, os_signal_handler);
 	signal(SIGTERM, os_signal_handler);
+}
+
+static struct termios
+os_init(void)
+{
+	os_init_signals();
 
 	char s[] = "\033[?25l\033[2J\033[H";
 	write_str(s, (sizeof s)-1);
@@ -838,10 +3765,69 @@ os_term(struct termios *termios)
 	write_str(s, (sizeof s)-1);
 }
 
+/* Terminal viewer for an exported frame, e.g. of a headless instance */
+static int
+shm_view(char *name)
+{
+	static struct chip8_program view;
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "error: cannot open shared memory %s: %s\n", name, strerror(errno));
+		return 1;
+	}
+	struct shm_frame *frame = mmap(NULL, sizeof *frame, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (frame == MAP_FAILED || frame->magic != SHM_MAGIC || frame->version != SHM_VERSION) {
+		fprintf(stderr, "error: %s is not a CHIP-8 frame export\n", name);
+		return 1;
+	}
+
+	struct termios old_state = os_init();
+	uint64_t shown = 0;
+	while (!Stop) {
+		int64_t time_now = os_get_time();
+		uint32_t before = atomic_load_explicit(&frame->sequence, memory_order_acquire);
+		if (!(before & 1) && frame->frame != shown) {
+			uint64_t counter = frame->frame;
+			view.mode = frame->mode;
+			view.hires = frame->hires;
+			memcpy(view.mem, frame->bitmap, sizeof frame->bitmap);
+			view.display = frame->display;
+			atomic_thread_fence(memory_order_acquire);
+			if (atomic_load_explicit(&frame->sequence, memory_order_relaxed) == before) {
+				shown = counter;
+				if (view.mode == CHIP8_MODE_CHIP8) {
+					os_bit_blit(view.mem);
+				} else {
+					os_display_blit(&view);
+				}
+			}
+		}
+		os_wait_frame(time_now);
+	}
+	os_term(&old_state);
+	munmap(frame, sizeof *frame);
+	return 0;
+}
+
+/* Octo's file extensions select the mode when none is given */
+static enum chip8_mode
+mode_from_filename(char *filename)
+{
+	char *ext = strrchr(filename, '.');
+	if (ext && strcmp(ext, ".sc8") == 0) {
+		return CHIP8_MODE_SCHIP;
+	}
+	if (ext && strcmp(ext, ".xo8") == 0) {
+		return CHIP8_MODE_XOCHIP;
+	}
+	return CHIP8_MODE_CHIP8;
+}
+
 static bool
-load_file(char *filename, struct chip8_program *dst)
+load_file(char *filename, struct chip8_program *dst, enum chip8_mode mode)
 {
-	uint8_t tmp[PROGRAM_MAX_SIZE+1];
+	static uint8_t tmp[XOCHIP_MAX_SIZE+1];
 	FILE *file = fopen(filename, "rb");
 	if (!file) {
 		fprintf(stderr, "error: cannot open program %s\n", filename);
@@ -854,35 +3840,505 @@ load_file(char *filename, struct chip8_program *dst)
 		fprintf(stderr, "error: cannot read program %s\n", filename);
 		return false;
 	}
-	if (!chip8_init(dst, tmp, nread)) {
+	if (!chip8_init(dst, tmp, nread, mode)) {
 		fprintf(stderr, "error: cannot load program %s\n", filename);
 		return false;
 	}
 	return true;
 }
 
+/* Static quirk detection: each check counts opcodes whose operands only make
+ * sense under one interpretation, and the quirk is changed from the default
+ * when the evidence is one-sided.
+ */
+static enum chip8_quirks
+chip8_detect_quirks(struct chip8_program *program, enum chip8_quirks quirks)
+{
+	static struct chip8_cfg cfg;
+	uint8_t *mem = program->mem;
+	uint16_t entry = 0x200;
+	int shift_vx = 0, shift_vy = 0;
+	int increment_i = 0, keep_i = 0;
+	int jump_vx = 0, jump_v0 = 0;
+	int wrap = 0;
+
+	chip8_analyze(&cfg, mem, 0x200, 0x200u + program->len, &entry, 1);
+	for (size_t b = 0; b < cfg.nblocks; b++) {
+		struct chip8_block *block = &cfg.blocks[b];
+		int known[16]; /* register values loaded by 6XNN in this block, -1 if unknown */
+		uint16_t written = 0;
+		for (int r = 0; r < 16; r++) {
+			known[r] = -1;
+		}
+		for (uint32_t pc = block->beg; pc <= block->end; pc += opcode_size(mem, pc)) {
+			struct chip8_opcode opcode = opcode_from_bytes(mem[pc], mem[pc+1]);
+			uint8_t x = opcode.vx;
+			switch (opcode.group) {
+			case 0x6:
+				known[x] = opcode.nn;
+				written |= (1 << x) & 0xFFFF;
+				break;
+			case 0x7:
+				known[x] = known[x] < 0 ? -1 : (known[x] + opcode.nn) & 0xFF;
+				written |= (1 << x) & 0xFFFF;
+				break;
+			case 0x8:
+				/* 8X06 with X != 0 only makes sense when VX is the source */
+				if ((opcode.n == 0x6 || opcode.n == 0xE) && x != opcode.vy) {
+					if (opcode.vy == 0) {
+						shift_vx++;
+					} else {
+						shift_vy++;
+					}
+				}
+				known[x] = -1;
+				known[0xF] = -1;
+				written |= (1 << x) & 0xFFFF;
+				break;
+			case 0xB:
+				/* an offset register loaded just before the jump tells which one is used */
+				if (opcode.nnn >> 8) {
+					if ((written & (1 << (opcode.nnn >> 8))) && !(written & 1)) {
+						jump_vx++;
+					} else if (written & 1) {
+						jump_v0++;
+					}
+				}
+				break;
+			case 0xC:
+				known[x] = -1;
+				written |= (1 << x) & 0xFFFF;
+				break;
+			case 0xD: {
+				/* a sprite at a constant position that crosses the edge expects wrapping */
+				int px = known[x];
+				int py = known[opcode.vy];
+				if ((px >= 0 && px % 64 + 8 > 64) || (py >= 0 && py % 32 + opcode.n > 32)) {
+					wrap++;
+				}
+				known[0xF] = -1;
+				break;
+			}
+			case 0xF:
+				if (opcode.nn == 0x07 || opcode.nn == 0x0A) {
+					known[x] = -1;
+					written |= (1 << x) & 0xFFFF;
+				}
+				if (opcode.nn != 0x55 && opcode.nn != 0x65) {
+					break;
+				}
+				if (opcode.nn == 0x65) {
+					for (uint8_t r = 0; r <= x; r++) {
+						known[r] = -1;
+					}
+					written |= (uint16_t)((2 << x) - 1);
+				}
+				/* the next use of I shows whether the program expects it to have moved */
+				for (uint32_t next = pc + opcode_size(mem, pc); next <= block->end; next += opcode_size(mem, next)) {
+					struct chip8_opcode use = opcode_from_bytes(mem[next], mem[next+1]);
+					if (use.group == 0xA || (use.group == 0xF && use.nn == 0x29)) {
+						break;
+					}
+					if (use.group == 0xF && use.nn == 0x1E) {
+						keep_i++;
+						break;
+					}
+					if (use.group == 0xD || (use.group == 0xF && (use.nn == 0x33 || use.nn == 0x55 || use.nn == 0x65))) {
+						increment_i++;
+						break;
+					}
+				}
+				break;
+			}
+		}
+	}
+
+	if (shift_vx > shift_vy) {
+		quirks |= CHIP8_QUIRK_SHIFT_VX;
+	} else if (shift_vy > shift_vx) {
+		quirks &= ~CHIP8_QUIRK_SHIFT_VX;
+	}
+	if (increment_i > keep_i) {
+		quirks |= CHIP8_QUIRK_INCREMENT_I;
+	} else if (keep_i > increment_i) {
+		quirks &= ~CHIP8_QUIRK_INCREMENT_I;
+	}
+	if (jump_vx > jump_v0) {
+		quirks |= CHIP8_QUIRK_JUMP_FROM_X;
+	} else if (jump_v0 > jump_vx) {
+		quirks &= ~CHIP8_QUIRK_JUMP_FROM_X;
+	}
+	if (wrap) {
+		quirks |= CHIP8_QUIRK_NO_CLIPPING;
+	}
+	return quirks;
+}
+
+/* The ROM index is a header followed by entries sorted by hash, in native
+ * byte order, so it can be mapped and searched without parsing.
+ */
+#define ROM_INDEX_MAGIC   0x58493843 /* "C8IX" */
+#define ROM_INDEX_VERSION 1
+
+struct rom_index_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct rom_index_entry
+{
+	uint64_t hash;
+	uint32_t quirks;
+	uint16_t len;
+	uint16_t reserved;
+};
+
+struct rom_index
+{
+	void *map;
+	size_t size;
+	struct rom_index_entry *entries;
+	size_t count;
+};
+
+static bool
+rom_index_open(struct rom_index *index, char *filename)
+{
+	memset(index, 0, sizeof *index);
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof (struct rom_index_header)) {
+		close(fd);
+		return false;
+	}
+	void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	struct rom_index_header *header = map;
+	size_t size = (size_t)st.st_size;
+	if (header->magic != ROM_INDEX_MAGIC || header->version != ROM_INDEX_VERSION ||
+	    header->count > (size - sizeof *header) / sizeof (struct rom_index_entry)) {
+		munmap(map, size);
+		return false;
+	}
+	index->map = map;
+	index->size = size;
+	index->entries = (struct rom_index_entry *)(header + 1);
+	index->count = header->count;
+	return true;
+}
+
+static void
+rom_index_close(struct rom_index *index)
+{
+	if (index->map) {
+		munmap(index->map, index->size);
+	}
+	memset(index, 0, sizeof *index);
+}
+
+static struct rom_index_entry *
+rom_index_find(struct rom_index *index, uint64_t hash, size_t len)
+{
+	size_t lo = 0;
+	size_t hi = index->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct rom_index_entry *entry = &index->entries[mid];
+		if (entry->hash < hash) {
+			lo = mid + 1;
+		} else if (entry->hash > hash) {
+			hi = mid;
+		} else {
+			return entry->len == len ? entry : NULL;
+		}
+	}
+	return NULL;
+}
+
+static int
+rom_index_compare(const void *a, const void *b)
+{
+	const struct rom_index_entry *x = a;
+	const struct rom_index_entry *y = b;
+	return (x->hash > y->hash) - (x->hash < y->hash);
+}
+
+/* Adds or replaces the entries for the given ROMs, keeping any others
+ * already in the index, and atomically replaces the index file.
+ */
+static bool
+rom_index_build(char *filename, char **roms, int count, enum chip8_quirks defaults)
+{
+	struct rom_index old;
+	bool have_old = rom_index_open(&old, filename);
+	size_t capacity = (have_old ? old.count : 0) + (size_t)count;
+	struct rom_index_entry *entries = calloc(capacity ? capacity : 1, sizeof *entries);
+	if (!entries) {
+		rom_index_close(&old);
+		return false;
+	}
+	size_t n = 0;
+	if (have_old) {
+		memcpy(entries, old.entries, old.count * sizeof *entries);
+		n = old.count;
+		rom_index_close(&old);
+	}
+
+	static struct chip8_program program;
+	for (int i = 0; i < count; i++) {
+		if (!load_file(roms[i], &program, mode_from_filename(roms[i]))) {
+			continue;
+		}
+		struct rom_index_entry entry = {
+			.hash = rom_hash(&program.mem[0x200], program.len),
+			.quirks = chip8_detect_quirks(&program, defaults),
+			.len = program.len
+		};
+		printf("%016llx %02x %s\n", (unsigned long long)entry.hash, entry.quirks, roms[i]);
+		size_t j = 0;
+		while (j < n && entries[j].hash != entry.hash) {
+			j++;
+		}
+		entries[j] = entry;
+		n += j == n;
+	}
+	qsort(entries, n, sizeof *entries, rom_index_compare);
+
+	char tmpname[PATH_MAX];
+	if (snprintf(tmpname, sizeof tmpname, "%s.tmp", filename) >= (int)sizeof tmpname) {
+		free(entries);
+		return false;
+	}
+	struct rom_index_header header = {
+		.magic = ROM_INDEX_MAGIC,
+		.version = ROM_INDEX_VERSION,
+		.count = (uint32_t)n
+	};
+	FILE *file = fopen(tmpname, "wb");
+	bool ok = file &&
+		  fwrite(&header, sizeof header, 1, file) == 1 &&
+		  fwrite(entries, sizeof *entries, n, file) == n;
+	if (file && fclose(file) != 0) {
+		ok = false;
+	}
+	free(entries);
+	if (!ok || rename(tmpname, filename) != 0) {
+		fprintf(stderr, "error: cannot write index %s\n", filename);
+		unlink(tmpname);
+		return false;
+	}
+	return true;
+}
+
+static bool
+parse_int(char *s, int min, int max, int *dst)
+{
+	char *end;
+	errno = 0;
+	long value = strtol(s, &end, 0);
+	if (errno || end == s || *end || value < min || value > max) {
+		return false;
+	}
+	*dst = (int)value;
+	return true;
+}
+
 int
 main(int argc, char **argv)
 {
 	struct chip8_program program;
 	bool disasm_and_quit = false;
+	bool cfg_and_quit = false;
+	char *index_build = NULL;
+	char *index_file = getenv("CHIP8_INDEX");
+	int quirks = -1;
+	int mode = -1;
+	int frames = 0;
+	int seed = 0;
+	char *audio_name = NULL;
+	static struct audio audio;
+	char *shm_name = NULL;
+	struct shm_export shm;
+	char *capture_name = NULL;
+	int capture_scale = 4;
+	bool capture_dedup = false;
+	int capture_format = -1;
+	static struct capture capture;
+	char *trace_name = NULL;
+	int trace_size = 1 << 20;
+	struct trace trace;
+	char *trace_print_name = NULL;
+	char *trace_diff_names[2] = { NULL, NULL };
+	struct trace_filter trace_filter = { .pc = -1, .write = -1, .grep = NULL, .last = 0 };
+	char *gdb_path = NULL;
+	static struct debugger debugger;
+	int engine = CHIP8_ENGINE_SWITCH;
+	int lockstep_engine = -1;
+	static struct lockstep lockstep;
+	struct chip8_context context = {
+		.program = &program,
+		.opcodes_per_frame = 10,
+		.keypad_response_time = 150,
+		.quirks = CHIP8_QUIRK_SHIFT_VX,
+		.governor = { .cpu_share = 0, .opcodes_min = 1 }
+	};
+
+	char **args = argv;
+	int nargs = argc;
+	int skip[2] = { 0, 0 };
 
 	setlocale(LC_ALL, "en_US.UTF-8");
 	--argc;
 	++argv;
-	if (argc) {
-		if (strcmp(*argv, "-disasm") == 0) {
+	while (argc && **argv == '-') {
+		char *opt = *argv;
+		char *arg = argc > 1 ? argv[1] : NULL;
+		if (strcmp(opt, "-disasm") == 0) {
 			disasm_and_quit = true;
+		} else if (strcmp(opt, "-cfg") == 0) {
+			cfg_and_quit = true;
+		} else if (strcmp(opt, "-chip8") == 0) {
+			mode = CHIP8_MODE_CHIP8;
+		} else if (strcmp(opt, "-schip") == 0) {
+			mode = CHIP8_MODE_SCHIP;
+		} else if (strcmp(opt, "-xochip") == 0) {
+			mode = CHIP8_MODE_XOCHIP;
+		} else if (strcmp(opt, "-ipf") == 0 && arg && parse_int(arg, 1, 100000, &context.opcodes_per_frame)) {
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-ipf-min") == 0 && arg && parse_int(arg, 1, 100000, &context.governor.opcodes_min)) {
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-governor") == 0 && arg && parse_int(arg, 1, 100, &context.governor.cpu_share)) {
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-quirks") == 0 && arg && parse_int(arg, 0, 0xFF, &quirks)) {
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-db") == 0 && arg) {
+			index_file = arg;
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-frames") == 0 && arg && parse_int(arg, 1, INT_MAX, &frames)) {
+			skip[0] = (int)(argv - args);
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-seed") == 0 && arg && parse_int(arg, 1, INT_MAX, &seed)) {
+			skip[1] = (int)(argv - args);
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-audio") == 0 && arg) {
+			audio_name = arg;
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-shm") == 0 && arg) {
+			shm_name = arg;
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-capture") == 0 && arg) {
+			capture_name = arg;
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-capture-scale") == 0 && arg && parse_int(arg, 1, 16, &capture_scale)) {
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-capture-dedup") == 0) {
+			capture_dedup = true;
+		} else if (strcmp(opt, "-capture-y4m") == 0) {
+			capture_format = CAPTURE_Y4M;
+		} else if (strcmp(opt, "-capture-raw") == 0) {
+			capture_format = CAPTURE_RAW;
+		} else if (strcmp(opt, "-trace") == 0 && arg) {
+			trace_name = arg;
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-trace-size") == 0 && arg && parse_int(arg, 1, 1 << 26, &trace_size)) {
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-trace-print") == 0 && arg) {
+			trace_print_name = arg;
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-trace-diff") == 0 && argc > 2) {
+			trace_diff_names[0] = argv[1];
+			trace_diff_names[1] = argv[2];
+			argc -= 2;
+			argv += 2;
+		} else if (strcmp(opt, "-trace-pc") == 0 && arg && parse_int(arg, 0, 0xFFFF, &trace_filter.pc)) {
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-trace-write") == 0 && arg && parse_int(arg, 0, MEMORY_SIZE - 1, &trace_filter.write)) {
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-trace-grep") == 0 && arg) {
+			trace_filter.grep = arg;
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-trace-last") == 0 && arg && parse_int(arg, 1, INT_MAX, &trace_filter.last)) {
+			--argc;
+			++argv;
+		} else if ((strcmp(opt, "-engine") == 0 || strcmp(opt, "-lockstep") == 0) && arg) {
+			int found = -1;
+			for (int k = 0; k < (int)(sizeof EngineNames / sizeof *EngineNames); k++) {
+				if (strcmp(arg, EngineNames[k]) == 0) {
+					found = k;
+				}
+			}
+			if (found < 0) {
+				fprintf(stderr, "error: unknown engine %s\n", arg);
+				return 1;
+			}
+			*(strcmp(opt, "-engine") == 0 ? &engine : &lockstep_engine) = found;
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-gdb") == 0 && arg) {
+			gdb_path = arg;
+			--argc;
+			++argv;
+		} else if (strcmp(opt, "-view") == 0 && arg) {
+			return shm_view(arg);
+		} else if (strcmp(opt, "-index") == 0 && arg) {
+			index_build = arg;
 			--argc;
 			++argv;
+		} else {
+			fprintf(stderr, "error: invalid option %s\n", opt);
+			return 1;
 		}
+		--argc;
+		++argv;
+	}
+	/* the fixed rate doubles as the governor's target speed */
+	context.governor.opcodes_max = context.opcodes_per_frame;
+	if (context.governor.opcodes_min > context.governor.opcodes_max) {
+		context.governor.opcodes_min = context.governor.opcodes_max;
+	}
+
+	if (index_build) {
+		return rom_index_build(index_build, argv, argc, quirks >= 0 ? (enum chip8_quirks)quirks : context.quirks) ? 0 : 1;
+	}
+	if (trace_print_name) {
+		return trace_print(trace_print_name, &trace_filter);
+	}
+	if (trace_diff_names[0]) {
+		return trace_diff(trace_diff_names[0], trace_diff_names[1]);
 	}
+
 	if (argc) {
-		if (!load_file(*argv, &program)) {
+		if (!load_file(*argv, &program, mode < 0 ? mode_from_filename(*argv) : (enum chip8_mode)mode)) {
 			return 1;
 		}
 	} else {
-		if (!chip8_init(&program, DemoRandomTimer, sizeof DemoRandomTimer)) {
+		if (!chip8_init(&program, DemoRandomTimer, sizeof DemoRandomTimer, mode < 0 ? CHIP8_MODE_CHIP8 : (enum chip8_mode)mode)) {
 			fprintf(stderr, "error: cannot load demo program\n");
 			return 1;
 		}
@@ -893,18 +4349,141 @@ main(int argc, char **argv)
 		return 0;
 	}
 
-	struct termios old_state = os_init();
+	if (cfg_and_quit) {
+		static struct chip8_cfg cfg;
+		struct out_buffer out = { .file = stdout, .len = 0 };
+		uint16_t entry = 0x200;
+		chip8_analyze(&cfg, program.mem, 0x200, 0x200u + program.len, &entry, 1);
+		chip8_cfg_print(&out, &cfg);
+		out_flush(&out);
+		return 0;
+	}
 
-	struct chip8_context context = {
-		.program = &program,
-		.opcodes_per_frame = 10,
-		.keypad_response_time = 150,
-		.quirks = CHIP8_QUIRK_SHIFT_VX
-	};
-	chip8_exec(&context);
+	if (quirks >= 0) {
+		context.quirks = (enum chip8_quirks)quirks;
+	} else if (index_file && *index_file) {
+		struct rom_index index;
+		if (rom_index_open(&index, index_file)) {
+			struct rom_index_entry *entry = rom_index_find(&index, rom_hash(&program.mem[0x200], program.len), program.len);
+			if (entry) {
+				context.quirks = (enum chip8_quirks)entry->quirks;
+			}
+			rom_index_close(&index);
+		} else {
+			fprintf(stderr, "warning: cannot open index %s\n", index_file);
+		}
+	}
 
-	os_term(&old_state);
+	context.rng = (uint32_t)seed;
+	if (audio_name) {
+		/* headless runs drain the ring themselves */
+		if (!audio_open(&audio, audio_name, frames == 0)) {
+			return 1;
+		}
+		context.audio = &audio;
+	}
+	if (shm_name) {
+		if (!shm_export_open(&shm, shm_name)) {
+			return 1;
+		}
+		context.shm = &shm;
+	}
+	if (capture_name) {
+		if (!frames && strcmp(capture_name, "-") == 0) {
+			fprintf(stderr, "error: -capture to stdout needs -frames\n");
+			return 1;
+		}
+		if (capture_format < 0) {
+			capture_format = (int)capture_format_from_filename(capture_name);
+		}
+		if (!capture_open(&capture, capture_name, (enum capture_format)capture_format, (unsigned)capture_scale,
+				  capture_dedup, (enum chip8_mode)program.mode)) {
+			return 1;
+		}
+		context.capture = &capture;
+	}
+	if (trace_name) {
+		/* the ring index is masked, so round up to a power of two */
+		uint32_t capacity = 1;
+		while (capacity < (uint32_t)trace_size) {
+			capacity <<= 1;
+		}
+		if (!trace_open(&trace, trace_name, true, capacity)) {
+			return 1;
+		}
+		trace.header->mode = program.mode;
+		trace.header->quirks = (uint8_t)context.quirks;
+		context.trace = &trace;
+	}
+	if (lockstep_engine >= 0 && gdb_path) {
+		/* a halt in the middle of a frame would show up as a divergence */
+		fprintf(stderr, "error: -lockstep cannot be used with -gdb\n");
+		return 1;
+	}
+	context.engine = (enum chip8_engine)engine;
+	if (context.engine == CHIP8_ENGINE_PREDECODE) {
+		context.decoded = calloc(0x10000, sizeof *context.decoded);
+		if (!context.decoded) {
+			fprintf(stderr, "error: out of memory for the predecode engine\n");
+			return 1;
+		}
+	}
+	if (lockstep_engine >= 0) {
+		/* the reference always runs the switch engine */
+		context.engine = CHIP8_ENGINE_SWITCH;
+		if (!lockstep_open(&lockstep, &context, (enum chip8_engine)lockstep_engine)) {
+			return 1;
+		}
+		if (frames) {
+			lockstep.argv = args;
+			lockstep.argc = nargs;
+			memcpy(lockstep.skip, skip, sizeof skip);
+		}
+		context.lockstep = &lockstep;
+	}
+	if (gdb_path) {
+		if (!debug_open(&debugger, gdb_path)) {
+			return 1;
+		}
+		context.debug = &debugger;
+	}
 
-	return 0;
-}
+	if (frames) {
+		os_init_signals();
+		chip8_exec_headless(&context, frames);
+	} else {
+		struct termios old_state = os_init();
+		chip8_exec(&context);
+		os_term(&old_state);
+	}
+
+	if (context.audio) {
+		audio_close(context.audio);
+	}
+	if (context.shm) {
+		shm_export_close(context.shm);
+	}
+	bool capture_failed = context.capture && !capture_close(context.capture);
+	if (context.trace) {
+		context.trace->header->count = context.trace->count;
+		trace_close(context.trace);
+	}
+	if (gdb_path) {
+		debug_close(&debugger);
+	}
+	if (context.lockstep) {
+		lockstep_close(context.lockstep);
+	}
+	free(context.decoded);
+
+	if (context.governor.cpu_share) {
+		governor_report(stderr, &context);
+	}
+
+	if (context.fault) {
+		fprintf(stderr, "stopped: %s at %03x\n", chip8_fault_name(context.fault), program.pc);
+	}
 
+	return lockstep.diverged || capture_failed ? 1 : 0;
+}
+#endif
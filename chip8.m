@@ -5,6 +5,8 @@
 #include <stdlib.h>
 
 #define PROGRAM_MAX_SIZE (0xEA0 - 0x200)
+#define XOCHIP_MAX_SIZE  (0x10000 - 0x200)
+#define MEMORY_SIZE      (0x10000 + 0x160) /* XO-CHIP address space plus the relocated stack, V and bitmap */
 #define STACK_MAX_SIZE   32
 
 /* Quirk flags */
@@ -18,17 +20,37 @@ enum chip8_quirks {
     CHIP8_QUIRK_VBLANK_WAIT = 0x20, /* DXYN a single sprite is drawn per VBLANK */
 };
 
+enum chip8_mode {
+    CHIP8_MODE_CHIP8  = 0, /* 64x32 bitmap aliased in mem[], 4 KB */
+    CHIP8_MODE_SCHIP  = 1, /* adds 128x64 hires, scrolling, 16x16 sprites, large font and flags */
+    CHIP8_MODE_XOCHIP = 2  /* adds 64 KB memory, two bitplanes and audio patterns */
+};
+
+/* SCHIP and XO-CHIP screen, see chip8.c */
+struct chip8_display {
+    uint64_t rows[2][64][2];
+};
+
 struct chip8_program {
     uint16_t pc;
     uint16_t sp;
-    uint16_t stack;
+    uint32_t stack;
     uint16_t i;
-    uint16_t v;
-    uint16_t bm;
+    uint32_t v;
+    uint32_t bm;
     uint16_t len;
+    uint16_t mask;
+    uint16_t top;
     uint8_t sound;
     uint8_t timer;
-    uint8_t mem[0x1000];
+    uint8_t mode;
+    uint8_t hires;
+    uint8_t planes;
+    uint8_t pitch;
+    uint8_t flags[16];
+    uint8_t pattern[16];
+    struct chip8_display display;
+    uint8_t mem[MEMORY_SIZE];
 };
 
 struct chip8_opcode {
@@ -60,6 +82,25 @@ static uint8_t Fonts[] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  /* Font F */
 };
 
+static uint8_t BigFonts[] = {
+    0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, /* Font 0 */
+    0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, /* Font 1 */
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, /* Font 2 */
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, /* Font 3 */
+    0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, /* Font 4 */
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, /* Font 5 */
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, /* Font 6 */
+    0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, /* Font 7 */
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, /* Font 8 */
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, /* Font 9 */
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, /* Font A */
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, /* Font B */
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, /* Font C */
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, /* Font D */
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, /* Font E */
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  /* Font F */
+};
+
 /* Demo program */
 static uint8_t DemoRandomTimer[] = {
     0x00, 0xE0, 0xC0, 0x0F, 0xF0, 0x29, 0x61, 0x1C,
@@ -83,22 +124,142 @@ opcode_from_bytes(uint8_t hi, uint8_t lo)
 }
 
 static bool
-chip8_init(struct chip8_program *program, uint8_t *data, size_t size)
+chip8_init(struct chip8_program *program, uint8_t *data, size_t size, enum chip8_mode mode)
 {
-    if (size > PROGRAM_MAX_SIZE) {
+    if (size > (mode == CHIP8_MODE_XOCHIP ? XOCHIP_MAX_SIZE : PROGRAM_MAX_SIZE)) {
         return false;
     }
+    /* XO-CHIP moves the stack, V and bitmap past the end of its 64 KB */
+    uint32_t system = mode == CHIP8_MODE_XOCHIP ? 0x10000 : 0xEA0;
     memset(program, 0, sizeof *program);
     memcpy(program->mem, Fonts, sizeof Fonts);
+    memcpy(program->mem + 0x50, BigFonts, sizeof BigFonts);
     memcpy(program->mem + 0x200, data, size);
-    program->pc    = 0x200;
-    program->stack = 0xEA0;
-    program->v     = 0xEF0;
-    program->bm    = 0xF00;
-    program->len   = (uint16_t)size;
+    program->pc     = 0x200;
+    program->stack  = system;
+    program->v      = system + 0x50;
+    program->bm     = system + 0x60;
+    program->len    = (uint16_t)size;
+    program->mask   = mode == CHIP8_MODE_XOCHIP ? 0xFFFF : 0xFFF;
+    program->top    = mode == CHIP8_MODE_XOCHIP ? 0xFFFF : 0xE9F;
+    program->mode   = (uint8_t)mode;
+    program->planes = 1;
+    program->pitch  = 64;
     return true;
 }
 
+static void
+display_row_mask(uint64_t mask[2], uint64_t bits, unsigned x, unsigned cols, bool wrap)
+{
+    uint64_t spill;
+    if (x < 64) {
+        mask[0] = bits >> x;
+        spill = x ? bits << (64 - x) : 0;
+        mask[1] = cols > 64 ? spill : 0;
+        if (cols > 64) {
+            spill = 0;
+        }
+    } else {
+        mask[0] = 0;
+        mask[1] = bits >> (x - 64);
+        spill = x > 64 ? bits << (128 - x) : 0;
+    }
+    if (wrap) {
+        mask[0] |= spill;
+    }
+}
+
+static bool
+display_draw(struct chip8_program *program, uint8_t x, uint8_t y, uint8_t n, bool wrap)
+{
+    struct chip8_display *display = &program->display;
+    uint8_t *mem = program->mem;
+    unsigned cols = program->hires ? 128 : 64;
+    unsigned rows = program->hires ? 64 : 32;
+    unsigned width = n ? 8 : 16;
+    unsigned height = n ? n : 16;
+    unsigned addr = program->i;
+    bool collision = false;
+
+    x = (uint8_t)(x % cols);
+    y = (uint8_t)(y % rows);
+    for (unsigned plane = 0; plane < 2; plane++) {
+        if (!(program->planes & (1 << plane))) {
+            continue;
+        }
+        for (unsigned r = 0; r < height; r++) {
+            unsigned yc = y + r;
+            if (yc >= rows) {
+                if (!wrap) {
+                    break;
+                }
+                yc -= rows;
+            }
+            uint64_t bits;
+            if (width == 16) {
+                bits = (uint64_t)mem[(addr + 2 * r) & program->mask] << 8 | mem[(addr + 2 * r + 1) & program->mask];
+            } else {
+                bits = mem[(addr + r) & program->mask];
+            }
+            uint64_t mask[2];
+            display_row_mask(mask, bits << (64 - width), x, cols, wrap);
+            uint64_t *row = display->rows[plane][yc];
+            collision |= ((row[0] & mask[0]) | (row[1] & mask[1])) != 0;
+            row[0] ^= mask[0];
+            row[1] ^= mask[1];
+        }
+        addr += width / 8 * height;
+    }
+    return collision;
+}
+
+static void
+display_clear(struct chip8_program *program, uint8_t planes)
+{
+    for (unsigned plane = 0; plane < 2; plane++) {
+        if (planes & (1 << plane)) {
+            memset(program->display.rows[plane], 0, sizeof program->display.rows[plane]);
+        }
+    }
+}
+
+static void
+display_scroll(struct chip8_program *program, int dx, int dy)
+{
+    unsigned rows = program->hires ? 64 : 32;
+    for (unsigned plane = 0; plane < 2; plane++) {
+        if (!(program->planes & (1 << plane))) {
+            continue;
+        }
+        uint64_t (*row)[2] = program->display.rows[plane];
+        if (dy > 0) {
+            unsigned n = (unsigned)dy < rows ? (unsigned)dy : rows;
+            memmove(row[n], row[0], (rows - n) * sizeof row[0]);
+            memset(row[0], 0, n * sizeof row[0]);
+        } else if (dy < 0) {
+            unsigned n = (unsigned)-dy < rows ? (unsigned)-dy : rows;
+            memmove(row[0], row[n], (rows - n) * sizeof row[0]);
+            memset(row[rows - n], 0, n * sizeof row[0]);
+        }
+        if (dx > 0) {
+            for (unsigned y = 0; y < rows; y++) {
+                row[y][1] = (row[y][1] >> dx) | (row[y][0] << (64 - dx));
+                row[y][0] >>= dx;
+            }
+        } else if (dx < 0) {
+            for (unsigned y = 0; y < rows; y++) {
+                row[y][0] = (row[y][0] << -dx) | (row[y][1] >> (64 + dx));
+                row[y][1] <<= -dx;
+            }
+        }
+        if (!program->hires) {
+            for (unsigned y = 0; y < rows; y++) {
+                row[y][1] = 0;
+            }
+        }
+    }
+}
+
 static bool
 chip8_exec_frame(struct chip8_program *program, int ops_per_frame, uint16_t keys_down,
                  bool *needs_beep, bool *key_held, uint8_t *held_key, enum chip8_quirks quirks)
@@ -107,23 +268,36 @@ chip8_exec_frame(struct chip8_program *program, int ops_per_frame, uint16_t keys
     uint8_t  *v      = &mem[program->v];
     uint8_t  *stack  = &mem[program->stack];
     uint8_t  *bitmap = &mem[program->bm];
+    uint16_t mask    = program->mask;
+    bool     extended = program->mode != CHIP8_MODE_CHIP8;
+    bool     xochip  = program->mode == CHIP8_MODE_XOCHIP;
     uint16_t last_pc;
     uint16_t temp;
+    uint16_t skip;
 
     *needs_beep = false;
 
     for (int i = 0; i < ops_per_frame; i++) {
-        if (program->pc < 0x200 || program->pc >= 0xE9F) {
+        if (program->pc < 0x200 || program->pc >= program->top) {
             return false;
         }
         last_pc = program->pc;
 
         struct chip8_opcode opcode = opcode_from_bytes(mem[program->pc], mem[program->pc + 1]);
+        /* XO-CHIP skips step over the whole of a 4 byte F000 NNNN */
+        skip = 4;
+        if (xochip && mem[program->pc + 2] == 0xF0 && mem[program->pc + 3] == 0x00) {
+            skip = 6;
+        }
         switch (opcode.group) {
         case 0x0:
             switch (opcode.nnn) {
             case 0xE0:
-                memset(bitmap, 0, 256);
+                if (extended) {
+                    display_clear(program, program->planes);
+                } else {
+                    memset(bitmap, 0, 256);
+                }
                 program->pc += 2;
                 break;
             case 0xEE:
@@ -133,7 +307,33 @@ chip8_exec_frame(struct chip8_program *program, int ops_per_frame, uint16_t keys
                 program->sp -= 2;
                 program->pc = (uint16_t)((stack[program->sp] << 8 | stack[program->sp + 1]) & 0xFFFF);
                 break;
+            case 0xFB:
+            case 0xFC:
+                if (extended) {
+                    display_scroll(program, opcode.nnn == 0xFB ? 4 : -4, 0);
+                }
+                program->pc += 2;
+                break;
+            case 0xFD:
+                if (extended) {
+                    return false;
+                }
+                program->pc += 2;
+                break;
+            case 0xFE:
+            case 0xFF:
+                if (extended) {
+                    program->hires = opcode.nnn == 0xFF;
+                    display_clear(program, 3);
+                }
+                program->pc += 2;
+                break;
             default:
+                if (extended && (opcode.nnn & 0xFF0) == 0x0C0) {
+                    display_scroll(program, 0, opcode.n);
+                } else if (xochip && (opcode.nnn & 0xFF0) == 0x0D0) {
+                    display_scroll(program, 0, -opcode.n);
+                }
                 program->pc += 2;
                 break;
             }
@@ -151,13 +351,28 @@ chip8_exec_frame(struct chip8_program *program, int ops_per_frame, uint16_t keys
             program->pc = opcode.nnn;
             break;
         case 0x3:
-            program->pc += v[opcode.vx] == opcode.nn ? 4 : 2;
+            program->pc += v[opcode.vx] == opcode.nn ? skip : 2;
             break;
         case 0x4:
-            program->pc += v[opcode.vx] != opcode.nn ? 4 : 2;
+            program->pc += v[opcode.vx] != opcode.nn ? skip : 2;
             break;
         case 0x5:
-            program->pc += v[opcode.vx] == v[opcode.vy] ? 4 : 2;
+            if (xochip && (opcode.n == 0x2 || opcode.n == 0x3)) {
+                int step = opcode.vx <= opcode.vy ? 1 : -1;
+                for (int r = opcode.vx, k = 0;; r += step, k++) {
+                    if (opcode.n == 0x2) {
+                        mem[(program->i + k) & mask] = v[r];
+                    } else {
+                        v[r] = mem[(program->i + k) & mask];
+                    }
+                    if (r == opcode.vy) {
+                        break;
+                    }
+                }
+                program->pc += 2;
+                break;
+            }
+            program->pc += v[opcode.vx] == v[opcode.vy] ? skip : 2;
             break;
         case 0x6:
             v[opcode.vx] = opcode.nn;
@@ -227,7 +442,7 @@ chip8_exec_frame(struct chip8_program *program, int ops_per_frame, uint16_t keys
             }
             break;
         case 0x9:
-            program->pc += v[opcode.vx] != v[opcode.vy] ? 4 : 2;
+            program->pc += v[opcode.vx] != v[opcode.vy] ? skip : 2;
             break;
         case 0xA:
             program->i = opcode.nnn;
@@ -245,6 +460,15 @@ chip8_exec_frame(struct chip8_program *program, int ops_per_frame, uint16_t keys
             program->pc += 2;
             break;
         case 0xD: {
+            if (extended) {
+                bool wrap = quirks & CHIP8_QUIRK_NO_CLIPPING;
+                v[0xF] = display_draw(program, v[opcode.vx], v[opcode.vy], opcode.n, wrap);
+                program->pc += 2;
+                if (quirks & CHIP8_QUIRK_VBLANK_WAIT) {
+                    goto frame_done;
+                }
+                break;
+            }
             uint8_t x0 = v[opcode.vx] % 64;
             uint8_t y0 = v[opcode.vy] % 32;
             v[0xF] = 0;
@@ -257,7 +481,7 @@ chip8_exec_frame(struct chip8_program *program, int ops_per_frame, uint16_t keys
                         break;
                     }
                 }
-                uint8_t sprite = mem[(program->i + y) & 0xFFF];
+                uint8_t sprite = mem[(program->i + y) & mask];
                 for (uint8_t sprite_mask = 1 << 7, x = 0; sprite_mask != 0; sprite_mask >>= 1, x++) {
                     if (!(sprite & sprite_mask)) {
                         continue;
@@ -271,9 +495,9 @@ chip8_exec_frame(struct chip8_program *program, int ops_per_frame, uint16_t keys
                         }
                     }
                     uint16_t byte = (uint16_t)((yc * 64 + xc) / 8);
-                    uint8_t mask = (uint8_t)(1 << (7 - xc % 8));
-                    v[0xF] |= !!(bitmap[byte] & mask);
-                    bitmap[byte] ^= mask;
+                    uint8_t byte_mask = (uint8_t)(1 << (7 - xc % 8));
+                    v[0xF] |= !!(bitmap[byte] & byte_mask);
+                    bitmap[byte] ^= byte_mask;
                 }
             }
             program->pc += 2;
@@ -285,15 +509,61 @@ chip8_exec_frame(struct chip8_program *program, int ops_per_frame, uint16_t keys
         case 0xE:
             switch (opcode.nn) {
             case 0x9E:
-                program->pc += (keys_down & (1 << (v[opcode.vx] & 0xF))) ? 4 : 2;
+                program->pc += (keys_down & (1 << (v[opcode.vx] & 0xF))) ? skip : 2;
                 break;
             case 0xA1:
-                program->pc += (keys_down & (1 << (v[opcode.vx] & 0xF))) ? 2 : 4;
+                program->pc += (keys_down & (1 << (v[opcode.vx] & 0xF))) ? 2 : skip;
                 break;
             }
             break;
         case 0xF:
             switch (opcode.nn) {
+            case 0x00:
+                if (xochip && opcode.vx == 0) {
+                    program->i = (uint16_t)(mem[program->pc + 2] << 8 | mem[program->pc + 3]);
+                    program->pc += 4;
+                }
+                break;
+            case 0x01:
+                if (xochip) {
+                    program->planes = opcode.vx & 0x3;
+                    program->pc += 2;
+                }
+                break;
+            case 0x02:
+                if (xochip && opcode.vx == 0) {
+                    for (uint8_t x = 0; x < 16; x++) {
+                        program->pattern[x] = mem[(program->i + x) & mask];
+                    }
+                    program->pc += 2;
+                }
+                break;
+            case 0x30:
+                if (extended) {
+                    program->i = (uint16_t)((0x50 + (v[opcode.vx] & 0xF) * 10) & mask);
+                    program->pc += 2;
+                }
+                break;
+            case 0x3A:
+                if (xochip) {
+                    program->pitch = v[opcode.vx];
+                    program->pc += 2;
+                }
+                break;
+            case 0x75:
+            case 0x85:
+                if (extended) {
+                    uint8_t count = (uint8_t)(xochip ? opcode.vx : opcode.vx & 0x7);
+                    for (uint8_t x = 0; x <= count; x++) {
+                        if (opcode.nn == 0x75) {
+                            program->flags[x] = v[x];
+                        } else {
+                            v[x] = program->flags[x];
+                        }
+                    }
+                    program->pc += 2;
+                }
+                break;
             case 0x07:
                 v[opcode.vx] = program->timer;
                 program->pc += 2;
@@ -320,34 +590,34 @@ chip8_exec_frame(struct chip8_program *program, int ops_per_frame, uint16_t keys
                 program->pc += 2;
                 break;
             case 0x1E:
-                program->i = (program->i + v[opcode.vx]) & 0xFFF;
+                program->i = (program->i + v[opcode.vx]) & mask;
                 program->pc += 2;
                 break;
             case 0x29:
-                program->i = (uint16_t)(((v[opcode.vx] & 0xF) * 5) & 0xFFF);
+                program->i = (uint16_t)(((v[opcode.vx] & 0xF) * 5) & mask);
                 program->pc += 2;
                 break;
             case 0x33:
-                mem[(program->i + 0) & 0xFFF] = v[opcode.vx] / 100;
-                mem[(program->i + 1) & 0xFFF] = v[opcode.vx] / 10 % 10;
-                mem[(program->i + 2) & 0xFFF] = v[opcode.vx] % 10;
+                mem[(program->i + 0) & mask] = v[opcode.vx] / 100;
+                mem[(program->i + 1) & mask] = v[opcode.vx] / 10 % 10;
+                mem[(program->i + 2) & mask] = v[opcode.vx] % 10;
                 program->pc += 2;
                 break;
             case 0x55:
                 for (uint8_t x = 0; x <= opcode.vx; x++) {
-                    mem[(program->i + x) & 0xFFF] = v[x];
+                    mem[(program->i + x) & mask] = v[x];
                 }
                 if (quirks & CHIP8_QUIRK_INCREMENT_I) {
-                    program->i = (program->i + opcode.vx + 1) & 0xFFF;
+                    program->i = (program->i + opcode.vx + 1) & mask;
                 }
                 program->pc += 2;
                 break;
             case 0x65:
                 for (uint8_t x = 0; x <= opcode.vx; x++) {
-                    v[x] = mem[(program->i + x) & 0xFFF];
+                    v[x] = mem[(program->i + x) & mask];
                 }
                 if (quirks & CHIP8_QUIRK_INCREMENT_I) {
-                    program->i = (program->i + opcode.vx + 1) & 0xFFF;
+                    program->i = (program->i + opcode.vx + 1) & mask;
                 }
                 program->pc += 2;
                 break;
@@ -407,20 +677,20 @@ frame_done:
         keyHeld = NO;
         heldKey = 0;
 
-        /* Allocate pixel buffer for 64x32 RGBA pixels */
-        pixelBuffer = (uint32_t *)malloc(64 * 32 * sizeof(uint32_t));
+        /* Allocate pixel buffer for 128x64 RGBA pixels; lores is drawn doubled */
+        pixelBuffer = (uint32_t *)malloc(128 * 64 * sizeof(uint32_t));
 
         /* Create bitmap context */
         CGColorSpaceRef colorSpace = CGColorSpaceCreateDeviceRGB();
         bitmapContext = CGBitmapContextCreate(pixelBuffer,
-                                              64, 32,
-                                              8, 64 * 4,
+                                              128, 64,
+                                              8, 128 * 4,
                                               colorSpace,
                                               (CGBitmapInfo)kCGImageAlphaPremultipliedLast);
         CGColorSpaceRelease(colorSpace);
 
         /* Load demo program */
-        chip8_init(&program, DemoRandomTimer, sizeof DemoRandomTimer);
+        chip8_init(&program, DemoRandomTimer, sizeof DemoRandomTimer, CHIP8_MODE_CHIP8);
 
         /* Register for drag and drop */
         [self registerForDraggedTypes:@[NSPasteboardTypeFileURL]];
@@ -452,22 +722,34 @@ frame_done:
 
 - (void)updatePixelBuffer
 {
-    uint8_t *video = &program.mem[0xF00];
+    uint8_t *video = &program.mem[program.bm];
 
     /* Colors in ABGR order (little-endian uint32_t for RGBA memory layout) */
-    /* Bright green: R=0, G=230, B=0, A=255 */
-    /* Dark green: R=0, G=51, B=0, A=255 */
-    const uint32_t fgColor = 0xFF00E600;
-    const uint32_t bgColor = 0xFF003300;
-
-    for (int y = 0; y < 32; y++) {
-        for (int x = 0; x < 64; x++) {
-            int bitIndex = y * 64 + x;
-            uint8_t byte = video[bitIndex / 8];
-            uint8_t mask = (uint8_t)(1 << (7 - (x % 8)));
-            BOOL pixelOn = (byte & mask) != 0;
-
-            pixelBuffer[y * 64 + x] = pixelOn ? fgColor : bgColor;
+    /* Dark green background, bright green for plane 1, yellow for plane 2, white for both */
+    const uint32_t colors[4] = { 0xFF003300, 0xFF00E600, 0xFF00E6E6, 0xFFFFFFFF };
+
+    if (program.mode == CHIP8_MODE_CHIP8) {
+        for (int y = 0; y < 64; y++) {
+            for (int x = 0; x < 128; x++) {
+                int bitIndex = (y / 2) * 64 + x / 2;
+                uint8_t byte = video[bitIndex / 8];
+                uint8_t mask = (uint8_t)(1 << (7 - (bitIndex % 8)));
+                pixelBuffer[y * 128 + x] = colors[(byte & mask) != 0];
+            }
+        }
+        return;
+    }
+
+    /* lores pixels are doubled; rows are 128-bit so a whole word is read per 64 pixels */
+    int scale = program.hires ? 1 : 2;
+    for (int y = 0; y < 64; y++) {
+        for (int x = 0; x < 128; x++) {
+            int px = x / scale;
+            int py = y / scale;
+            uint64_t bit = (uint64_t)1 << (63 - px % 64);
+            int value = ((program.display.rows[0][py][px / 64] & bit) ? 1 : 0) |
+                        ((program.display.rows[1][py][px / 64] & bit) ? 2 : 0);
+            pixelBuffer[y * 128 + x] = colors[value];
         }
     }
 }
@@ -626,12 +908,20 @@ frame_done:
     }
 
     NSData *data = [NSData dataWithContentsOfURL:fileURL];
-    if (!data || data.length == 0 || data.length > PROGRAM_MAX_SIZE) {
+    if (!data || data.length == 0 || data.length > XOCHIP_MAX_SIZE) {
         return NO;
     }
 
+    /* Octo's file extensions select the mode */
+    enum chip8_mode mode = CHIP8_MODE_CHIP8;
+    if ([fileURL.pathExtension isEqualToString:@"sc8"]) {
+        mode = CHIP8_MODE_SCHIP;
+    } else if ([fileURL.pathExtension isEqualToString:@"xo8"]) {
+        mode = CHIP8_MODE_XOCHIP;
+    }
+
     /* Reset emulator with new ROM */
-    if (chip8_init(&program, (uint8_t *)data.bytes, data.length)) {
+    if (chip8_init(&program, (uint8_t *)data.bytes, data.length, mode)) {
         halted = NO;
         keysDown = 0;
         keyHeld = NO;